@@ -4,16 +4,97 @@
 /* Seen by kernel and user */
 #define SCHED_MONITOR_MODULE_NAME "sched_monitor"
 
-/* ioctl commands to enable/disable tracking */
+/* ioctl commands to enable/disable tracking. With preempt notifiers only the
+ * task that enabled tracking may disable it (-EPERM otherwise).
+ */
 #define ENABLE_TRACKING     0xdeadbeef
 #define DISABLE_TRACKING    0xdeaddead
 
+/* ioctl command to choose what to track, see struct tracking_target */
+#define SET_TRACKING_TARGET 0xdead7a67
+
+/* Tracking targets. TRACK_SELF follows the task that enables tracking, using
+ * preempt notifiers when the kernel has them. Every other target, and
+ * TRACK_SELF on kernels without CONFIG_PREEMPT_NOTIFIERS, attaches to the
+ * sched_switch tracepoint. Targets other than TRACK_SELF need CAP_SYS_ADMIN.
+ * The target can only be changed while tracking is disabled.
+ */
+#define TRACK_SELF      0
+#define TRACK_PID       1   /* all threads of process 'id', in the caller's pid namespace */
+#define TRACK_CGROUP    2   /* tasks below the cgroup v2 directory open as fd 'id' */
+#define TRACK_SYSTEM    3   /* every task but the idle tasks */
+
+struct tracking_target {
+    int type;
+    int id;
+};
+
+/* ioctl commands for flight recorder mode, see struct flight_recorder_config */
+#define CONFIGURE_FLIGHT_RECORDER   0xdeadf00d
+#define ARM_FLIGHT_RECORDER         0xdeadf1a9
+
+/* Flight recorder mode keeps only the last 'capacity' events, overwriting the
+ * oldest. Once a task waits on the runqueue for at least 'threshold' ns (the
+ * time_wait of an event; time it spends blocked does not count), the recorder
+ * keeps 'post_trigger' (< capacity) more events and then freezes, making the device
+ * readable for poll(). ARM_FLIGHT_RECORDER clears the buffer and starts over.
+ * A capacity of 0 returns to the default streaming mode. Can only be changed
+ * while tracking is disabled; anything recorded so far is discarded. Only
+ * available for TRACK_SELF with preempt notifiers.
+ */
+struct flight_recorder_config {
+    unsigned int capacity;
+    unsigned int post_trigger;
+    unsigned long long threshold;
+};
+
+/* ioctl command to read the counters of a descriptor, see struct tracking_stats */
+#define GET_TRACKING_STATS  0xdead57a7
+
+/* Counters since tracking was last enabled. 'dropped' counts events lost to
+ * allocation failures or, with the sched_switch backend, to MAX_PREEMPTS
+ * (32768) unread entries piling up. The *_ns times are only collected when
+ * the module is loaded with collect_stats=1 and are 0 otherwise.
+ * Callback times cover the notifier callbacks or the part of the sched_switch
+ * probe spent on this descriptor. Of that, 'lock_wait' is spent acquiring the
+ * descriptor's lock and 'alloc' in kmalloc(GFP_ATOMIC) (notifier streaming
+ * mode only). On the read() side, 'reads' entries were handed out, after
+ * waiting 'read_lock_wait' for the lock and spending 'copy' in copy_to_user.
+ */
+struct tracking_stats {
+    unsigned long long recorded;
+    unsigned long long dropped;
+    unsigned long long queued;
+    unsigned long long callbacks;
+    unsigned long long callback_ns;
+    unsigned long long callback_max_ns;
+    unsigned long long lock_wait_ns;
+    unsigned long long lock_wait_max_ns;
+    unsigned long long allocs;
+    unsigned long long alloc_ns;
+    unsigned long long alloc_max_ns;
+    unsigned long long reads;
+    unsigned long long read_lock_wait_ns;
+    unsigned long long read_lock_wait_max_ns;
+    unsigned long long copy_ns;
+    unsigned long long copy_max_ns;
+};
+
 /* Data structure for user<->kernel transfer */
 typedef struct preemption_info {
     /* populate with info to transfer from kernel to user */
     int cpu;
+    /* task (thread) id the entry belongs to */
+    int pid;
+    /* wall clock time (ns) at which the task was scheduled off */
+    unsigned long long time_stamp;
     unsigned long long time_on;
     unsigned long long time_off;
+    /* part of time_off spent runnable, i.e. wakeup (or preemption) to
+     * sched_in. 0 if the wakeup of a blocked task was not observed */
+    unsigned long long time_wait;
+    /* 1 if the task blocked, 0 if it was preempted */
+    int voluntary;
     char preempted_by[16];
 } __attribute__((packed)) preemption_info_t;
 
@@ -38,6 +119,39 @@ disable_preemption_tracking(int fd)
 {
     return ioctl(fd, DISABLE_TRACKING, 0);
 }
+
+/* Function to read the counters */
+static inline int
+get_tracking_stats(int                    fd,
+                   struct tracking_stats * stats)
+{
+    return ioctl(fd, GET_TRACKING_STATS, stats);
+}
+
+/* Function to choose what to track */
+static inline int
+set_tracking_target(int fd,
+                    int type,
+                    int id)
+{
+    struct tracking_target target = { .type = type, .id = id };
+
+    return ioctl(fd, SET_TRACKING_TARGET, &target);
+}
+
+/* Functions to configure/re-arm the flight recorder */
+static inline int
+configure_flight_recorder(int                                   fd,
+                          const struct flight_recorder_config * config)
+{
+    return ioctl(fd, CONFIGURE_FLIGHT_RECORDER, config);
+}
+
+static inline int
+arm_flight_recorder(int fd)
+{
+    return ioctl(fd, ARM_FLIGHT_RECORDER, 0);
+}
 #endif
 
 #endif
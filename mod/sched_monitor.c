@@ -4,35 +4,115 @@
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
 #include <linux/sched.h>
+#include <linux/pid.h>
 #include <linux/gfp.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/list.h>
 #include <linux/time.h>
+#include <linux/tracepoint.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/hash.h>
+#include <linux/mutex.h>
+#include <linux/atomic.h>
+#include <linux/rculist.h>
+#include <linux/cgroup.h>
+#include <linux/capability.h>
 
 #include <asm/uaccess.h>
 
 
-/* DO NOT MODIFY THIS CHECK. If you see the message in the error line below
- * when compliling your module, that means your kernel has not been configured
- * correctly. Complete exercises 1-3 of the lab before continuing
+/* Preempt notifiers are used to follow the task that enables tracking when the
+ * kernel has them. Everything else, including self-tracking on kernels without
+ * CONFIG_PREEMPT_NOTIFIERS, goes through the sched_switch tracepoint.
  */
 #ifdef CONFIG_PREEMPT_NOTIFIERS
 #include <linux/preempt.h>
-#else
-#error "Your kernel must be built with CONFIG_PREEMPT_NOTIFIERS enabled"
 #endif
 
 #include <sched_monitor.h>
 
 #define MAX_PREEMPTS 32768
 
+/* The timings in struct tracking_stats take several local_clock() calls per
+ * context switch, so they are only taken when the module is loaded with
+ * collect_stats=1. The counters are always kept. Read-only once loaded, so a
+ * measurement never mixes timed and untimed halves.
+ */
+static bool collect_stats;
+module_param(collect_stats, bool, 0444);
+MODULE_PARM_DESC(collect_stats, "Time callbacks, lock waits, allocations and copies (default 0)");
+
+/* buckets of the per-tracker table of tasks that are being followed */
+#define PENDING_HASH_BITS 8
+
 struct preemption_tracker
 {
+#ifdef CONFIG_PREEMPT_NOTIFIERS
     /* notifier to register us with the kernel's callback mechanisms */
     struct preempt_notifier notifier;
+#endif
     bool enabled;
+    /* task whose notifier list we are registered on, pinned while set */
+    struct task_struct * task;
+    /* the notifier is linked on 'task', protected by 'lock' */
+    bool registered;
+    /* the file was released while the notifier was still linked on another
+     * task. That task unlinks it on its next switch out and frees the tracker
+     * through 'rcu'; until then nothing is recorded.
+     */
+    bool orphaned;
+    struct rcu_head rcu;
+
+    /* what to track, see SET_TRACKING_TARGET */
+    int target;
+    pid_t target_id;
+    /* TRACK_PID: the process, resolved in the caller's pid namespace */
+    struct pid * target_pid;
+    struct cgroup * cgroup;
+    /* tracking through the sched_switch tracepoint rather than a notifier */
+    bool switch_backend;
+    /* on switch_trackers while the sched_switch backend is enabled */
+    struct list_head switch_list;
+    /* sched_switch backend: the current entry of every tracked task, keyed
+     * by pid. Entries move to 'list' when the task is switched out again.
+     */
+    struct hlist_head pending[1 << PENDING_HASH_BITS];
+    /* sched_switch backend: entries preallocated at ENABLE time. The probe
+     * runs under the runqueue lock and must not allocate.
+     */
+    struct list_head free;
+    unsigned int nr_free;
     struct list_head list;
     spinlock_t lock;
+    /* time the tracked task was last woken up, set by the sched_wakeup probe */
+    unsigned long long wakeup;
+
+    /* Flight recorder mode, used instead of 'list' when 'ring' is set. The
+     * last ring_size entries are kept in a preallocated ring, overwriting the
+     * oldest. A gap of at least 'threshold' triggers the recorder, which
+     * freezes after 'post_trigger' further events and wakes up pollers.
+     */
+    struct preemption_entry * ring;
+    unsigned int ring_size;
+    unsigned int ring_head;
+    unsigned int ring_count;
+    unsigned long long threshold;
+    unsigned int post_trigger;
+    unsigned int post_remaining;
+    bool triggered;
+    bool frozen;
+    wait_queue_head_t waitq;
+
+    /* entries on 'list' */
+    unsigned int queued;
+    /* counters for GET_TRACKING_STATS, protected by 'lock' except for the
+     * copy_to_user times, which are taken after it is dropped
+     */
+    struct tracking_stats stats;
+    atomic64_t copy_ns;
+    atomic64_t copy_max_ns;
 };
 
 
@@ -43,8 +123,19 @@ struct preemption_entry
     int core;
     unsigned long long start;
     unsigned long long end;
+    /* start of the next entry of the same task, 0 if not known yet */
+    unsigned long long next_start;
+    /* time spent runnable before 'end', i.e. waiting on the runqueue */
+    unsigned long long wait;
+    /* sched_switch backend: last wakeup of the task while off the CPU */
+    unsigned long long wakeup;
+    /* the task blocked rather than being preempted */
+    bool voluntary;
+    pid_t pid;
     struct list_head list;
-    char* preempted_by;    
+    struct hlist_node pending;
+    /* copied, the preempting task may be gone by the time we are read */
+    char preempted_by[TASK_COMM_LEN];
 };
 
 
@@ -55,10 +146,10 @@ struct preemption_entry
 static inline unsigned long long
 get_current_time(void)
 {
-    struct timespec* ts;
+    struct timespec ts;
     unsigned long long ns;
-    getnstimeofday(ts);
-    ns = (unsigned long long) timespec_to_ns(ts);	
+    getnstimeofday(&ts);
+    ns = (unsigned long long) timespec_to_ns(&ts);	
     return ns;
 }
 
@@ -81,6 +172,131 @@ retrieve_tracker_of_process(struct file * file)
     return (struct preemption_tracker *)file->private_data;
 }
 
+/*
+ * Flight recorder ring. All of these are called with tracker->lock held.
+ */
+
+static inline struct preemption_entry *
+ring_entry(struct preemption_tracker * tracker,
+           unsigned int                nr)
+{
+    return &tracker->ring[(tracker->ring_head + nr) % tracker->ring_size];
+}
+
+/* Most recent entry, or NULL if the ring is empty */
+static inline struct preemption_entry *
+ring_last_entry(struct preemption_tracker * tracker)
+{
+    if (tracker->ring_count == 0) {
+        return NULL;
+    }
+    return ring_entry(tracker, tracker->ring_count - 1);
+}
+
+static void
+ring_reset(struct preemption_tracker * tracker)
+{
+    tracker->ring_head = 0;
+    tracker->ring_count = 0;
+    tracker->triggered = false;
+    tracker->frozen = false;
+}
+
+static void
+reset_stats(struct preemption_tracker * tracker)
+{
+    memset(&tracker->stats, 0, sizeof(tracker->stats));
+    atomic64_set(&tracker->copy_ns, 0);
+    atomic64_set(&tracker->copy_max_ns, 0);
+}
+
+/* local_clock(), or 0 when timings are not collected */
+static inline u64
+stats_clock(void)
+{
+    return collect_stats ? local_clock() : 0;
+}
+
+static inline void
+account_time(unsigned long long * total,
+             unsigned long long * max,
+             u64                  ns)
+{
+    *total += ns;
+    if (ns > *max) {
+        *max = ns;
+    }
+}
+
+/* Take tracker->lock, returning how long that took */
+static inline u64
+lock_tracker(struct preemption_tracker * tracker,
+             unsigned long             * flags)
+{
+    u64 begin = stats_clock();
+
+    spin_lock_irqsave(&tracker->lock, *flags);
+    return stats_clock() - begin;
+}
+
+/* Account a callback that started at 'begin', as returned by stats_clock(),
+ * and waited 'lock_wait' ns for the lock. Called with tracker->lock held.
+ */
+static inline void
+account_callback(struct preemption_tracker * tracker,
+                 u64                         begin,
+                 u64                         lock_wait)
+{
+    tracker->stats.callbacks++;
+    account_time(&tracker->stats.callback_ns, &tracker->stats.callback_max_ns, stats_clock() - begin);
+    account_time(&tracker->stats.lock_wait_ns, &tracker->stats.lock_wait_max_ns, lock_wait);
+}
+
+/* Initialise a new entry for a task that is being switched out at 'now' */
+static inline void
+start_entry(struct preemption_entry * entry,
+            struct task_struct      * task,
+            struct task_struct      * next,
+            bool                      voluntary,
+            unsigned long long        now)
+{
+    entry->start = now;
+    entry->end = 0;
+    entry->next_start = 0;
+    entry->wait = 0;
+    entry->wakeup = 0;
+    entry->pid = task->pid;
+    entry->voluntary = voluntary;
+    memcpy(entry->preempted_by, next->comm, TASK_COMM_LEN);
+}
+
+/* Record that the task of 'entry' got a CPU back at 'now'. 'wakeup' is the
+ * last time the task was woken up.
+ */
+static inline void
+complete_entry(struct preemption_entry * entry,
+               int                       cpu,
+               unsigned long long        now,
+               unsigned long long        wakeup)
+{
+    entry->core = cpu;
+    entry->end = now;
+
+	/* A preempted task was runnable the whole time it was off the CPU. A task
+	 * that blocked only starts waiting once it is woken up; if we missed the
+	 * wakeup the delay is unknown and reported as 0.
+	 */
+	if(!entry->voluntary) {
+		entry->wait = entry->end - entry->start;
+	} else if(wakeup >= entry->start) {
+		entry->wait = entry->end - wakeup;
+	} else {
+		entry->wait = 0;
+	}
+}
+
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+
 /*
  * Utility to retrieve a tracking structure based on the 
  * preemption_notifier structure.
@@ -93,6 +309,51 @@ retrieve_tracker_of_notifier(struct preempt_notifier * notifier)
     return container_of(notifier, struct preemption_tracker, notifier);
 }
 
+/* Slot for a new entry, overwriting the oldest one if the ring is full.
+ * Returns NULL once the recorder is frozen.
+ */
+static struct preemption_entry *
+ring_next_entry(struct preemption_tracker * tracker)
+{
+    if (tracker->frozen) {
+        return NULL;
+    }
+
+    if (tracker->ring_count == tracker->ring_size) {
+        tracker->ring_head = (tracker->ring_head + 1) % tracker->ring_size;
+        tracker->ring_count--;
+    }
+
+    return ring_entry(tracker, tracker->ring_count++);
+}
+
+/* Check a completed entry against the trigger. Returns true if the recorder
+ * just froze and the poller should be woken up.
+ */
+static bool
+flight_recorder_update(struct preemption_tracker * tracker,
+                       struct preemption_entry   * entry)
+{
+    if (!tracker->triggered) {
+        /* a task sleeping on purpose is not stalled, only time spent
+         * runnable without a CPU counts */
+        if (entry->wait < tracker->threshold) {
+            return false;
+        }
+        tracker->triggered = true;
+        tracker->post_remaining = tracker->post_trigger;
+    } else if (tracker->post_remaining > 0) {
+        tracker->post_remaining--;
+    }
+
+    if (tracker->post_remaining == 0) {
+        tracker->frozen = true;
+        return true;
+    }
+
+    return false;
+}
+
 /* 
  * Callbacks for preemption notifications.
  *
@@ -115,6 +376,32 @@ retrieve_tracker_of_notifier(struct preempt_notifier * notifier)
  * to it as needed to provide the information above.
  */
 
+static void
+free_orphan_rcu(struct rcu_head * rcu)
+{
+    struct preemption_tracker * tracker = container_of(rcu, struct preemption_tracker, rcu);
+
+    put_task_struct(tracker->task);
+    kfree(tracker);
+    module_put(THIS_MODULE);
+}
+
+/* Unlink the notifier from inside the owner's own sched_out, under the
+ * runqueue lock. The notifier walk only reads link.next after we return,
+ * which __hlist_del() leaves intact, and an orphaned tracker is only freed
+ * after a sched-RCU grace period. Called with tracker->lock held.
+ */
+static void
+notifier_detach(struct preemption_tracker * tracker)
+{
+    __hlist_del(&tracker->notifier.link);
+    tracker->registered = false;
+
+    if (tracker->orphaned) {
+        call_rcu_sched(&tracker->rcu, free_orphan_rcu);
+    }
+}
+
 static void
 monitor_sched_in(struct preempt_notifier * pn,
                  int                       cpu)
@@ -122,15 +409,46 @@ monitor_sched_in(struct preempt_notifier * pn,
     struct preemption_tracker * tracker = retrieve_tracker_of_notifier(pn);
     struct preemption_entry* entry;
     unsigned long flags;
-	printk(KERN_INFO "sched_in for process %s\n", current->comm);
+    bool wake = false;
+    u64 begin = stats_clock(), lock_wait;
+
     /*record information as needed */
-    spin_lock_irqsave(&tracker->lock, flags);
+    lock_wait = lock_tracker(tracker, &flags);
 
-	entry = list_last_entry(&tracker->list,struct preemption_entry, list); 
-    entry->core = cpu;
-    entry->end = get_current_time();
-	
+	if(tracker->orphaned) {
+		spin_unlock_irqrestore(&tracker->lock, flags);
+		return;
+	}
+
+	if(tracker->ring) {
+		entry = ring_last_entry(tracker);
+	} else if(!list_empty(&tracker->list)) {
+		entry = list_last_entry(&tracker->list,struct preemption_entry, list); 
+	} else {
+		entry = NULL;
+	}
+
+	if(!entry || entry->end) {
+		account_callback(tracker, begin, lock_wait);
+		spin_unlock_irqrestore(&tracker->lock, flags);
+		return;
+	}
+
+	complete_entry(entry, cpu, get_current_time(), tracker->wakeup);
+
+	if(tracker->ring) {
+		wake = flight_recorder_update(tracker, entry);
+	}
+
+	account_callback(tracker, begin, lock_wait);
 	spin_unlock_irqrestore(&tracker->lock, flags);    
+
+	/* Unlike sched_out, sched_in runs after the runqueue lock is dropped, so
+	 * it is safe to wake up the poller from here.
+	 */
+	if(wake) {
+		wake_up_interruptible(&tracker->waitq);
+	}
 	
  }
 
@@ -139,23 +457,74 @@ monitor_sched_out(struct preempt_notifier * pn,
                   struct task_struct      * next)
 {
     struct preemption_tracker * tracker = retrieve_tracker_of_notifier(pn);
-    struct preemption_entry* entry;
+    struct preemption_entry* entry, * last, * spare = NULL;
+    unsigned long long now;
     unsigned long flags;
-	printk(KERN_INFO "sched_out for process %s\n", current->comm);
-   
-	/* record information as needed */
-    entry  = kmalloc(sizeof(struct preemption_entry), GFP_ATOMIC);
-    if(!entry) {
-		printk(KERN_ERR "Failed to kmalloc preempt_entry\n");
+    u64 begin = stats_clock(), lock_wait, alloc = 0;
+    bool allocated = false;
+
+	/* Runs under the runqueue lock: no printk in here.
+	 *
+	 * Unlocked peeks. Streaming mode keeps every event until it is read;
+	 * a failed allocation is counted as dropped.
+	 */
+	if(!tracker->ring && !READ_ONCE(tracker->orphaned)) {
+		alloc = stats_clock();
+		spare = kmalloc(sizeof(struct preemption_entry), GFP_ATOMIC);
+		alloc = stats_clock() - alloc;
+		allocated = true;
+	}
+
+	lock_wait = lock_tracker(tracker, &flags);
+
+	/* the file is gone, see sched_monitor_release */
+	if(tracker->orphaned) {
+		notifier_detach(tracker);
+		spin_unlock_irqrestore(&tracker->lock, flags);
+		kfree(spare);
 		return;
 	}
-	
-	spin_lock_irqsave(&tracker->lock, flags);
 
-	list_add_tail(&entry->list, &tracker->list);    
-    entry->start = get_current_time();
-    entry->preempted_by = next->comm;
-    spin_unlock_irqrestore(&tracker->lock, flags);   
+	if(allocated) {
+		tracker->stats.allocs++;
+		account_time(&tracker->stats.alloc_ns, &tracker->stats.alloc_max_ns, alloc);
+	}
+	now = get_current_time();
+
+	if(tracker->ring) {
+		last = ring_last_entry(tracker);
+		if(last && !tracker->frozen) {
+			last->next_start = now;
+		}
+		entry = ring_next_entry(tracker);
+	} else {
+		if(!list_empty(&tracker->list)) {
+			last = list_last_entry(&tracker->list, struct preemption_entry, list);
+			last->next_start = now;
+		}
+
+		entry = spare;
+		if(entry) {
+			list_add_tail(&entry->list, &tracker->list);    
+			tracker->queued++;
+		} else {
+			tracker->stats.dropped++;
+		}
+	}
+
+	if(entry) {
+		/* __schedule() has already dequeued a task that blocks, while a
+		 * preempted one stays on the runqueue whatever its state */
+		start_entry(entry, current, next, !current->on_rq, now);
+		tracker->stats.recorded++;
+	}
+	account_callback(tracker, begin, lock_wait);
+
+	/* final switch of the owner, nobody else may unlink us later */
+	if(current->state == TASK_DEAD) {
+		notifier_detach(tracker);
+	}
+	spin_unlock_irqrestore(&tracker->lock, flags);   
 }
 
 static struct preempt_ops
@@ -165,9 +534,450 @@ notifier_ops =
     .sched_out = monitor_sched_out
 };
 
+/* Register on the current task, which becomes the owner */
+static void
+notifier_register(struct preemption_tracker * tracker)
+{
+    get_task_struct(current);
+    tracker->task = current;
+    tracker->registered = true;
+    preempt_notifier_register(&tracker->notifier);
+    tracker->enabled = true;
+}
+
+/* Unregister from the owner. Must run on the owner unless the notifier has
+ * already been unlinked because the owner exited.
+ */
+static void
+notifier_unregister(struct preemption_tracker * tracker)
+{
+    unsigned long flags;
+    bool registered;
+
+    spin_lock_irqsave(&tracker->lock, flags);
+    registered = tracker->registered;
+    tracker->registered = false;
+    spin_unlock_irqrestore(&tracker->lock, flags);
+
+    if (registered) {
+        preempt_notifier_unregister(&tracker->notifier);
+    }
+
+    put_task_struct(tracker->task);
+    tracker->task = NULL;
+    tracker->enabled = false;
+}
+
+#endif /* CONFIG_PREEMPT_NOTIFIERS */
+
 /*** END preemption notifier ***/
 
 
+/*
+ * sched_switch backend. Trackers that are not following themselves through a
+ * preempt notifier are kept on 'switch_trackers', which the probe walks under
+ * RCU (tracepoint probes run with preemption disabled). The probe is only
+ * attached while at least one such tracker is enabled, and filters before
+ * taking any lock or reading the clock, so switches of untracked tasks cost a
+ * list walk and a few compares.
+ */
+
+static struct tracepoint * sched_switch_tp;
+static struct tracepoint * sched_wakeup_tp;
+
+static LIST_HEAD(switch_trackers);
+/* protects switch_trackers against concurrent updates */
+static DEFINE_SPINLOCK(switch_trackers_lock);
+/* serialises attaching/detaching the sched_switch probe */
+static DEFINE_MUTEX(switch_probe_mutex);
+static unsigned int switch_probe_users;
+
+static void
+free_entries(struct list_head * entries)
+{
+    struct preemption_entry * pos, * next;
+
+    list_for_each_entry_safe(pos, next, entries, list) {
+        kfree(pos);
+    }
+}
+
+/* Top up the free entries of a tracker to MAX_PREEMPTS */
+static int
+fill_free_entries(struct preemption_tracker * tracker)
+{
+    struct preemption_entry * entry;
+    unsigned long flags;
+    unsigned int i, count;
+    LIST_HEAD(entries);
+
+    spin_lock_irqsave(&tracker->lock, flags);
+    count = tracker->nr_free < MAX_PREEMPTS ? MAX_PREEMPTS - tracker->nr_free : 0;
+    spin_unlock_irqrestore(&tracker->lock, flags);
+
+    for (i = 0; i < count; i++) {
+        entry = kmalloc(sizeof(struct preemption_entry), GFP_KERNEL);
+        if (!entry) {
+            free_entries(&entries);
+            return -ENOMEM;
+        }
+        list_add(&entry->list, &entries);
+    }
+
+    spin_lock_irqsave(&tracker->lock, flags);
+    list_splice(&entries, &tracker->free);
+    tracker->nr_free += count;
+    spin_unlock_irqrestore(&tracker->lock, flags);
+
+    return 0;
+}
+
+/* Give an entry back to the free list. Called with tracker->lock held. */
+static inline void
+put_free_entry(struct preemption_tracker * tracker,
+               struct preemption_entry   * entry)
+{
+    list_add(&entry->list, &tracker->free);
+    tracker->nr_free++;
+}
+
+#ifdef CONFIG_CGROUPS
+/* task_css_set() needs RCU proper, which sched-RCU does not imply */
+static inline bool
+task_in_cgroup(struct task_struct * task,
+               struct cgroup      * cgroup)
+{
+    bool ret;
+
+    rcu_read_lock();
+    ret = task_under_cgroup_hierarchy(task, cgroup);
+    rcu_read_unlock();
+
+    return ret;
+}
+#endif
+
+static inline bool
+tracker_follows_task(struct preemption_tracker * tracker,
+                     struct task_struct        * task)
+{
+    switch (tracker->target) {
+        case TRACK_SELF:
+            return task->pid == tracker->target_id;
+        case TRACK_PID:
+            return task_tgid(task) == tracker->target_pid;
+#ifdef CONFIG_CGROUPS
+        case TRACK_CGROUP:
+            return task->pid != 0 && task_in_cgroup(task, tracker->cgroup);
+#endif
+        case TRACK_SYSTEM:
+            /* the idle tasks all have pid 0 */
+            return task->pid != 0;
+        default:
+            return false;
+    }
+}
+
+static inline struct hlist_head *
+pending_bucket(struct preemption_tracker * tracker,
+               pid_t                       pid)
+{
+    return &tracker->pending[hash_32(pid, PENDING_HASH_BITS)];
+}
+
+/* Current entry of a followed task. Called with tracker->lock held. */
+static struct preemption_entry *
+pending_entry(struct preemption_tracker * tracker,
+              pid_t                       pid)
+{
+    struct preemption_entry * entry;
+
+    hlist_for_each_entry(entry, pending_bucket(tracker, pid), pending) {
+        if (entry->pid == pid) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* 'prev' is being switched out. Its previous entry, if complete, becomes
+ * readable and a new one is started from the free list. Called with
+ * tracker->lock held, under the runqueue lock: nothing in here may allocate,
+ * print or wake anything up.
+ */
+static void
+switch_out(struct preemption_tracker * tracker,
+           struct task_struct        * prev,
+           struct task_struct        * next,
+           bool                        voluntary,
+           unsigned long long          now)
+{
+    struct preemption_entry * entry = pending_entry(tracker, prev->pid);
+
+    if (entry) {
+        hlist_del(&entry->pending);
+        if (entry->end) {
+            entry->next_start = now;
+            list_add_tail(&entry->list, &tracker->list);
+            tracker->queued++;
+        } else {
+            put_free_entry(tracker, entry);
+        }
+    }
+
+    /* final switch of an exiting task */
+    if (prev->state == TASK_DEAD) {
+        return;
+    }
+
+    /* the reader has fallen MAX_PREEMPTS entries behind */
+    if (list_empty(&tracker->free)) {
+        tracker->stats.dropped++;
+        return;
+    }
+
+    entry = list_first_entry(&tracker->free, struct preemption_entry, list);
+    list_del(&entry->list);
+    tracker->nr_free--;
+
+    start_entry(entry, prev, next, voluntary, now);
+    hlist_add_head(&entry->pending, pending_bucket(tracker, prev->pid));
+    tracker->stats.recorded++;
+}
+
+/* 'next' is being switched in. Called with tracker->lock held. */
+static void
+switch_in(struct preemption_tracker * tracker,
+          struct task_struct        * next,
+          int                         cpu,
+          unsigned long long          now)
+{
+    struct preemption_entry * entry = pending_entry(tracker, next->pid);
+
+    if (entry && !entry->end) {
+        complete_entry(entry, cpu, now, entry->wakeup);
+    }
+}
+
+/* Probe for sched_switch, as of Linux 4.4 (before 'prev_state' was added) */
+static void
+monitor_sched_switch(void               * data,
+                     bool                 preempt,
+                     struct task_struct * prev,
+                     struct task_struct * next)
+{
+    struct preemption_tracker * tracker;
+    unsigned long long now = 0;
+    bool out, in;
+    int cpu = smp_processor_id();
+    u64 begin, lock_wait;
+
+    list_for_each_entry_rcu(tracker, &switch_trackers, switch_list) {
+        out = tracker_follows_task(tracker, prev);
+        in = tracker_follows_task(tracker, next);
+        if (!out && !in) {
+            continue;
+        }
+
+        begin = stats_clock();
+        if (!now) {
+            now = get_current_time();
+        }
+
+        /* interrupts are already disabled by the scheduler */
+        lock_wait = stats_clock();
+        spin_lock(&tracker->lock);
+        lock_wait = stats_clock() - lock_wait;
+        if (out) {
+            switch_out(tracker, prev, next, !preempt && prev->state != TASK_RUNNING, now);
+        }
+        if (in) {
+            switch_in(tracker, next, cpu, now);
+        }
+        account_callback(tracker, begin, lock_wait);
+        spin_unlock(&tracker->lock);
+    }
+}
+
+/* Start following the tracker's target through sched_switch */
+static int
+switch_tracking_enable(struct preemption_tracker * tracker)
+{
+    LIST_HEAD(unused);
+    unsigned long flags;
+    int status;
+
+    if (tracker->target == TRACK_SELF) {
+        tracker->target_id = current->pid;
+    }
+
+    status = fill_free_entries(tracker);
+    if (status) {
+        return status;
+    }
+
+    mutex_lock(&switch_probe_mutex);
+
+    if (switch_probe_users == 0) {
+        if (!sched_switch_tp) {
+            status = -ENODEV;
+        } else {
+            status = tracepoint_probe_register(sched_switch_tp, monitor_sched_switch, NULL);
+        }
+    }
+
+    if (status == 0) {
+        switch_probe_users++;
+
+        spin_lock_irqsave(&switch_trackers_lock, flags);
+        list_add_tail_rcu(&tracker->switch_list, &switch_trackers);
+        spin_unlock_irqrestore(&switch_trackers_lock, flags);
+
+        tracker->switch_backend = true;
+        tracker->enabled = true;
+    }
+
+    mutex_unlock(&switch_probe_mutex);
+
+    if (status) {
+        spin_lock_irqsave(&tracker->lock, flags);
+        list_splice_init(&tracker->free, &unused);
+        tracker->nr_free = 0;
+        spin_unlock_irqrestore(&tracker->lock, flags);
+        free_entries(&unused);
+    }
+
+    return status;
+}
+
+/* Stop following the tracker's target. Complete entries of tasks that are
+ * currently running stay readable, entries of tasks still off the CPU are
+ * dropped since their gap has no end. The free list is released.
+ */
+static void
+switch_tracking_disable(struct preemption_tracker * tracker)
+{
+    struct preemption_entry * entry;
+    struct hlist_node * tmp;
+    unsigned long flags;
+    int bucket;
+    LIST_HEAD(unused);
+
+    mutex_lock(&switch_probe_mutex);
+
+    spin_lock_irqsave(&switch_trackers_lock, flags);
+    list_del_rcu(&tracker->switch_list);
+    spin_unlock_irqrestore(&switch_trackers_lock, flags);
+
+    if (--switch_probe_users == 0) {
+        tracepoint_probe_unregister(sched_switch_tp, monitor_sched_switch, NULL);
+    }
+
+    mutex_unlock(&switch_probe_mutex);
+
+    /* no probe may still be using the tracker */
+    tracepoint_synchronize_unregister();
+
+    tracker->enabled = false;
+    tracker->switch_backend = false;
+
+    spin_lock_irqsave(&tracker->lock, flags);
+    for (bucket = 0; bucket < (1 << PENDING_HASH_BITS); bucket++) {
+        hlist_for_each_entry_safe(entry, tmp, &tracker->pending[bucket], pending) {
+            hlist_del(&entry->pending);
+            if (entry->end) {
+                list_add_tail(&entry->list, &tracker->list);
+                tracker->queued++;
+            } else {
+                put_free_entry(tracker, entry);
+            }
+        }
+    }
+    list_splice_init(&tracker->free, &unused);
+    tracker->nr_free = 0;
+    spin_unlock_irqrestore(&tracker->lock, flags);
+
+    free_entries(&unused);
+}
+
+/*** END sched_switch backend ***/
+
+
+/*
+ * sched_wakeup tracepoint, used to timestamp wakeups of tracked tasks so that
+ * runqueue latency can be separated from sleep time.
+ */
+
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+/* Stamp the wakeup on every tracker registered on a task; several open
+ * descriptors may follow the same task. The notifier list of a task is only
+ * modified by the task itself, which cannot happen while it is being woken up.
+ */
+static inline void
+stamp_wakeup_of_task(struct task_struct * task)
+{
+    struct preemption_tracker * tracker;
+    struct preempt_notifier * pn;
+    unsigned long flags;
+
+    hlist_for_each_entry(pn, &task->preempt_notifiers, link) {
+        if (pn->ops != &notifier_ops) {
+            continue;
+        }
+
+        tracker = retrieve_tracker_of_notifier(pn);
+        spin_lock_irqsave(&tracker->lock, flags);
+        tracker->wakeup = get_current_time();
+        spin_unlock_irqrestore(&tracker->lock, flags);
+    }
+}
+#endif
+
+static void
+monitor_sched_wakeup(void               * data,
+                     struct task_struct * task)
+{
+    struct preemption_tracker * tracker;
+    struct preemption_entry * entry;
+    unsigned long flags;
+
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+    /* Fast path for the vast majority of wakeups */
+    if (!hlist_empty(&task->preempt_notifiers)) {
+        stamp_wakeup_of_task(task);
+    }
+#endif
+
+    list_for_each_entry_rcu(tracker, &switch_trackers, switch_list) {
+        if (!tracker_follows_task(tracker, task)) {
+            continue;
+        }
+
+        spin_lock_irqsave(&tracker->lock, flags);
+        entry = pending_entry(tracker, task->pid);
+        if (entry && !entry->end) {
+            entry->wakeup = get_current_time();
+        }
+        spin_unlock_irqrestore(&tracker->lock, flags);
+    }
+}
+
+/* Scheduler tracepoints are not exported to modules, so look them up by name */
+static void
+lookup_tracepoints(struct tracepoint * tp,
+                   void              * priv)
+{
+    if (!strcmp(tp->name, "sched_wakeup")) {
+        sched_wakeup_tp = tp;
+    } else if (!strcmp(tp->name, "sched_switch")) {
+        sched_switch_tp = tp;
+    }
+}
+
+/*** END sched_wakeup tracepoint ***/
+
+
 /*
  * Device I/O callbacks for user<->kernel communication 
  */
@@ -182,6 +992,7 @@ sched_monitor_open(struct inode * inode,
                    struct file  * file)
 {
     struct preemption_tracker * tracker;
+    int bucket;
 
     printk(KERN_DEBUG "Process %d (%s) opened " DEV_NAME "\n",
         current->pid, current->comm);
@@ -203,10 +1014,35 @@ sched_monitor_open(struct inode * inode,
 
 	/* Save tracker so that we can access it on other file operations from this process */
  	INIT_LIST_HEAD(&tracker->list);
+	INIT_LIST_HEAD(&tracker->free);
+	tracker->nr_free = 0;
 	tracker->enabled = false;
+	tracker->task = NULL;
+	tracker->registered = false;
+	tracker->orphaned = false;
+	tracker->wakeup = 0;
+	tracker->ring = NULL;
+	tracker->ring_size = 0;
+	ring_reset(tracker);
+	init_waitqueue_head(&tracker->waitq);
 	spin_lock_init(&tracker->lock);
 
+	tracker->queued = 0;
+	reset_stats(tracker);
+
+	tracker->target = TRACK_SELF;
+	tracker->target_id = 0;
+	tracker->target_pid = NULL;
+	tracker->cgroup = NULL;
+	tracker->switch_backend = false;
+	INIT_LIST_HEAD(&tracker->switch_list);
+	for(bucket = 0; bucket < (1 << PENDING_HASH_BITS); bucket++) {
+		INIT_HLIST_HEAD(&tracker->pending[bucket]);
+	}
+
+#ifdef CONFIG_PREEMPT_NOTIFIERS
 	preempt_notifier_init(&tracker->notifier, &notifier_ops);  
+#endif
 	save_tracker_of_process(file, tracker);
 
 
@@ -214,10 +1050,11 @@ sched_monitor_open(struct inode * inode,
 
 }
 
-/* This function is invoked when a user closes /dev/sched_monitor.
- * You must update is to free the 'tracker' variable allocated in the 
- * sched_monitor_open callback, as well as free any other dynamically 
- * allocated data structures you may have allocated (such as linked lists)
+/* This function is invoked every time a descriptor for /dev/sched_monitor is
+ * closed. The file may be shared with other processes (e.g. inherited across
+ * fork), so only the task that registered the notifier may unregister it here;
+ * everything else is torn down in sched_monitor_release once the last
+ * reference goes away.
  */
 static int
 sched_monitor_flush(struct file * file,
@@ -228,12 +1065,49 @@ sched_monitor_flush(struct file * file,
     printk(KERN_DEBUG "Process %d (%s) closed " DEV_NAME "\n",
         current->pid, current->comm);
 
+    /* Unregister notifier. 'task' is only set when using one. */
+    if (tracker->enabled && !tracker->switch_backend && tracker->task == current) {
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+       	notifier_unregister(tracker);
+#endif
+    }
+
+    return 0;
+}
+
+/* This function is invoked when the last reference to the file is dropped.
+ * Free the 'tracker' variable allocated in the sched_monitor_open callback,
+ * as well as any entries that were never read.
+ */
+static int
+sched_monitor_release(struct inode * inode,
+                      struct file  * file)
+{
+    struct preemption_tracker * tracker = retrieve_tracker_of_process(file);
+
 	unsigned long long time_sched_on;
 	unsigned long long time_sched_off;
 	char * comm;
 	int cpu;
 	/*Print the list of preempt_entries and delete them */
 	struct preemption_entry *pos, *next;
+	unsigned long flags;
+	bool orphaned;
+
+	/* moves leftover pending entries to the list */
+	if(tracker->switch_backend) {
+		switch_tracking_disable(tracker);
+	}
+
+	/* The notifier may still be linked on a task that never closed us, e.g.
+	 * when another thread dropped the last reference. Only that task may
+	 * unlink it, so the tracker outlives the file until its next switch.
+	 */
+	spin_lock_irqsave(&tracker->lock, flags);
+	orphaned = tracker->registered;
+	tracker->orphaned = orphaned;
+	spin_unlock_irqrestore(&tracker->lock, flags);
+
 	list_for_each_entry_safe(pos, next, &tracker->list, list) {
 		cpu = pos->core;
 		comm = pos->preempted_by;
@@ -248,21 +1122,37 @@ sched_monitor_flush(struct file * file,
 		kfree(pos);
 	}
 
+    /* left over by reads racing with the disable above */
+    free_entries(&tracker->free);
+    vfree(tracker->ring);
 
-    /* Unregister notifier */
-    if (tracker->enabled) {
-       	preempt_notifier_unregister(&tracker->notifier);
-        
+    put_pid(tracker->target_pid);
+#ifdef CONFIG_CGROUPS
+    if (tracker->cgroup) {
+        cgroup_put(tracker->cgroup);
+    }
+#endif
+
+    /* freed by free_orphan_rcu(), which needs the module to stay loaded */
+    if (orphaned) {
+        __module_get(THIS_MODULE);
+        return 0;
+    }
+
+    /* the sched_wakeup probe may still be looking at the tracker */
+    synchronize_sched();
+    if (tracker->task) {
+        put_task_struct(tracker->task);
     }
     kfree(tracker);
-    
 
     return 0;
 }
 
 /* 
  * Enable/disable preemption tracking for the process that opened this file.
- * Do so by registering/unregistering preemption notifiers.
+ * Do so by registering/unregistering preemption notifiers, or for other
+ * targets by attaching to sched_switch.
  */
 static long
 sched_monitor_ioctl(struct file * file,
@@ -270,6 +1160,15 @@ sched_monitor_ioctl(struct file * file,
                     unsigned long arg)
 {
     struct preemption_tracker * tracker = retrieve_tracker_of_process(file);
+    struct flight_recorder_config config;
+    struct tracking_target target;
+    struct tracking_stats stats;
+    struct preemption_entry * ring, * pos, * next;
+    struct cgroup * cgroup;
+    struct pid * pid;
+    unsigned long flags;
+    int status;
+    LIST_HEAD(discarded);
 
     switch (cmd) {
         case ENABLE_TRACKING:
@@ -279,14 +1178,36 @@ sched_monitor_ioctl(struct file * file,
                 return 0;
             }
 
-            /* register notifier, set enabled to true, and remove the error return */
-            preempt_notifier_register(&tracker->notifier);
-            tracker->enabled = true;
+            spin_lock_irqsave(&tracker->lock, flags);
+            reset_stats(tracker);
+            spin_unlock_irqrestore(&tracker->lock, flags);
 
-            printk(KERN_DEBUG "Process %d (%s) enabled preemption tracking via " DEV_NAME ".\n",
-                current->pid, current->comm);
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+            if (tracker->target == TRACK_SELF) {
+                /* register notifier, set enabled to true, and remove the error return */
+                notifier_register(tracker);
+
+                printk(KERN_DEBUG "Process %d (%s) enabled preemption tracking via " DEV_NAME ".\n",
+                    current->pid, current->comm);
+
+                break;
+            }
+#endif
 
-    
+            /* the flight recorder is only filled by the notifier callbacks */
+            if (tracker->ring) {
+                return -EINVAL;
+            }
+
+            status = switch_tracking_enable(tracker);
+            if (status) {
+                printk(KERN_ERR "Could not attach to sched_switch for process %d (%s)\n",
+                    current->pid, current->comm);
+                return status;
+            }
+
+            printk(KERN_DEBUG "Process %d (%s) enabled preemption tracking of target %d (%d) via " DEV_NAME ".\n",
+                current->pid, current->comm, tracker->target, tracker->target_id);
 
             break;
 
@@ -298,14 +1219,167 @@ sched_monitor_ioctl(struct file * file,
                 return 0;
             }
 
-            /*unregister notifier, set enabled to true, and remove the error return */
-            tracker->enabled = false;
-	    preempt_notifier_unregister(&tracker->notifier);
+            if (tracker->switch_backend) {
+                switch_tracking_disable(tracker);
+            }
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+            else {
+                /* Only the owner may touch its notifier list. Anyone may clean
+                 * up after an owner that has exited.
+                 */
+                spin_lock_irqsave(&tracker->lock, flags);
+                status = tracker->registered && tracker->task != current;
+                spin_unlock_irqrestore(&tracker->lock, flags);
+                if (status) {
+                    return -EPERM;
+                }
+
+                /*unregister notifier, set enabled to true, and remove the error return */
+                notifier_unregister(tracker);
+            }
+#endif
             printk(KERN_DEBUG "Process %d (%s) disabled preemption tracking via " DEV_NAME ".\n",
                 current->pid, current->comm);
 
            
 
+            break;
+
+        /* Choose what to track. Following anything but ourselves exposes
+         * other tasks and needs CAP_SYS_ADMIN.
+         */
+        case SET_TRACKING_TARGET:
+            if (tracker->enabled) {
+                return -EBUSY;
+            }
+
+            if (copy_from_user(&target, (void __user *)arg, sizeof(target))) {
+                return -EFAULT;
+            }
+
+            if (target.type != TRACK_SELF && !capable(CAP_SYS_ADMIN)) {
+                return -EPERM;
+            }
+
+            cgroup = NULL;
+            pid = NULL;
+            switch (target.type) {
+                case TRACK_SELF:
+                case TRACK_SYSTEM:
+                    break;
+                case TRACK_PID:
+                    if (target.id <= 0) {
+                        return -EINVAL;
+                    }
+                    /* 'id' is in the caller's pid namespace */
+                    pid = find_get_pid(target.id);
+                    if (!pid) {
+                        return -ESRCH;
+                    }
+                    break;
+#ifdef CONFIG_CGROUPS
+                case TRACK_CGROUP:
+                    cgroup = cgroup_get_from_fd(target.id);
+                    if (IS_ERR(cgroup)) {
+                        return PTR_ERR(cgroup);
+                    }
+                    break;
+#endif
+                default:
+                    return -EINVAL;
+            }
+
+#ifdef CONFIG_CGROUPS
+            if (tracker->cgroup) {
+                cgroup_put(tracker->cgroup);
+            }
+#endif
+            put_pid(tracker->target_pid);
+            tracker->target_pid = pid;
+            tracker->cgroup = cgroup;
+            tracker->target = target.type;
+            tracker->target_id = target.id;
+
+            break;
+
+        /* Switch between streaming and flight recorder mode. Anything
+         * recorded so far is discarded.
+         */
+        case CONFIGURE_FLIGHT_RECORDER:
+            if (tracker->enabled) {
+                return -EBUSY;
+            }
+
+#ifndef CONFIG_PREEMPT_NOTIFIERS
+            return -EINVAL;
+#endif
+
+            if (copy_from_user(&config, (void __user *)arg, sizeof(config))) {
+                return -EFAULT;
+            }
+
+            /* the event that fires the trigger must survive until the
+             * recorder freezes
+             */
+            if (config.capacity > MAX_PREEMPTS ||
+                (config.capacity && config.post_trigger >= config.capacity)) {
+                return -EINVAL;
+            }
+
+            /* up to several MB, so do not ask for contiguous pages */
+            ring = NULL;
+            if (config.capacity) {
+                ring = vzalloc(config.capacity * sizeof(struct preemption_entry));
+                if (!ring) {
+                    return -ENOMEM;
+                }
+            }
+
+            spin_lock_irqsave(&tracker->lock, flags);
+            swap(tracker->ring, ring);
+            tracker->ring_size = config.capacity;
+            tracker->threshold = config.threshold;
+            tracker->post_trigger = config.post_trigger;
+            ring_reset(tracker);
+            list_splice_init(&tracker->list, &discarded);
+            tracker->queued = 0;
+            spin_unlock_irqrestore(&tracker->lock, flags);
+
+            vfree(ring);
+            list_for_each_entry_safe(pos, next, &discarded, list) {
+                kfree(pos);
+            }
+
+            printk(KERN_DEBUG "Process %d (%s) configured flight recorder via " DEV_NAME
+                ": capacity %u, threshold %llu ns, post trigger %u\n",
+                current->pid, current->comm, config.capacity, config.threshold, config.post_trigger);
+
+            break;
+
+        case GET_TRACKING_STATS:
+            spin_lock_irqsave(&tracker->lock, flags);
+            stats = tracker->stats;
+            stats.queued = tracker->ring ? tracker->ring_count : tracker->queued;
+            spin_unlock_irqrestore(&tracker->lock, flags);
+            stats.copy_ns = atomic64_read(&tracker->copy_ns);
+            stats.copy_max_ns = atomic64_read(&tracker->copy_max_ns);
+
+            if (copy_to_user((void __user *)arg, &stats, sizeof(stats))) {
+                return -EFAULT;
+            }
+
+            break;
+
+        /* Start recording again after a trigger */
+        case ARM_FLIGHT_RECORDER:
+            if (!tracker->ring) {
+                return -EINVAL;
+            }
+
+            spin_lock_irqsave(&tracker->lock, flags);
+            ring_reset(tracker);
+            spin_unlock_irqrestore(&tracker->lock, flags);
+
             break;
 
         default:
@@ -316,6 +1390,24 @@ sched_monitor_ioctl(struct file * file,
     return 0;
 }
 
+/* Convert an entry to the user-visible format */
+static void
+fill_preemption_info(preemption_info_t       * info,
+                     struct preemption_entry * entry)
+{
+	memset(info, 0, sizeof(*info));
+	info->cpu = entry->core;
+	info->pid = entry->pid;
+	info->time_stamp = entry->start;
+	memcpy(info->preempted_by, entry->preempted_by, sizeof(info->preempted_by));
+	info->time_off = entry->end - entry->start;
+	info->time_wait = entry->wait;
+	info->voluntary = entry->voluntary;
+
+	/* If this is the last entry, it marks the final sched_off  */
+	info->time_on = entry->next_start ? entry->next_start - entry->end : 0;
+}
+
 /* User read /dev/sched_monitor
  *
  * In this function, you will copy an entry from the list of preemptions
@@ -332,45 +1424,74 @@ sched_monitor_read(struct file * file,
     unsigned long flags;
 	struct preemption_entry * entry;
 	preemption_info_t info;
-	unsigned long long start, end;
+	u64 lock_wait, copy, max;
+	unsigned long left;
 	if(length != sizeof(preemption_info_t)) {
 		return -EINVAL;
 	}
 
-	spin_lock_irqsave(&tracker->lock, flags);
+	lock_wait = lock_tracker(tracker, &flags);
+
+	if(tracker->ring) {
+		entry = tracker->ring_count ? ring_entry(tracker, 0) : NULL;
+	} else if(!list_empty(&tracker->list)) {
+		entry = list_first_entry(&tracker->list, struct preemption_entry, list);
+	} else {
+		entry = NULL;
+	}
 	
-	if(list_empty(&tracker->list)) {
-		printk(KERN_DEBUG "preempt_entry list is empty!\n");
+	/* The task may still be off the CPU for the most recent entry, or, while
+	 * the notifier is registered, still on the CPU after it: handing it out
+	 * then would lose its time_on. The switch backend only queues entries
+	 * once both are known. */
+	if(!entry || !entry->end ||
+	   (tracker->registered && !tracker->ring && !entry->next_start)) {
 		spin_unlock_irqrestore(&tracker->lock, flags);
 		return 0;
 	}
 	
 	/*Copy information from preempt_entry to buffer */
-	entry = list_first_entry(&tracker->list, struct preemption_entry, list);
-	start = entry->start;
-	end = entry->end;
-		
-	info.cpu = entry->core;
-	memcpy(&info.preempted_by, entry->preempted_by, 16); //16 is max len of comm name
-	info.time_off = end - start;
+	fill_preemption_info(&info, entry);
 
-	/* If this is the last entry, it marks the final sched_off  */
-	if( unlikely( list_is_last(&entry->list, &tracker->list) )) {
-		info.time_on = 0;
+	tracker->stats.reads++;
+	account_time(&tracker->stats.read_lock_wait_ns, &tracker->stats.read_lock_wait_max_ns, lock_wait);
+
+	if(tracker->ring) {
+		tracker->ring_head = (tracker->ring_head + 1) % tracker->ring_size;
+		tracker->ring_count--;
+		entry = NULL;
 	} else {
-		info.time_on = list_next_entry(entry, list)->start - end;
+		list_del(&entry->list);
+		tracker->queued--;
+		/* the sched_switch probe cannot allocate, recycle for it */
+		if(tracker->switch_backend && tracker->nr_free < MAX_PREEMPTS) {
+			put_free_entry(tracker, entry);
+			entry = NULL;
+		}
 	}
 
-	if(copy_to_user(buffer, &info, length)) {
-		printk(KERN_ERR "Failed to copy preempt_info to user!\n");
-		spin_unlock_irqrestore(&tracker->lock, flags);
-		return -EFAULT;
-	}
+	spin_unlock_irqrestore(&tracker->lock, flags);
 
-	list_del(&entry->list);
+	/* ring entries are reused in place */
 	kfree(entry);
 
-	spin_unlock_irqrestore(&tracker->lock, flags);
+	/* copy_to_user may fault, so it must not run under the spinlock */
+	copy = stats_clock();
+	left = copy_to_user(buffer, &info, length);
+
+	if(collect_stats) {
+		copy = local_clock() - copy;
+		atomic64_add(copy, &tracker->copy_ns);
+		max = atomic64_read(&tracker->copy_max_ns);
+		while(copy > max && atomic64_cmpxchg(&tracker->copy_max_ns, max, copy) != max) {
+			max = atomic64_read(&tracker->copy_max_ns);
+		}
+	}
+
+	if(left) {
+		printk(KERN_ERR "Failed to copy preempt_info to user!\n");
+		return -EFAULT;
+	}
 
     /*  
      * (1) make sure length is valid. It must be an even multiuple of the size of preemption_info_t.
@@ -385,7 +1506,7 @@ sched_monitor_read(struct file * file,
      * (7) unlock the list
      */
 
-    printk(KERN_DEBUG "Process %d (%s) read " DEV_NAME "\n",
+    pr_debug("Process %d (%s) read " DEV_NAME "\n",
         current->pid, current->comm);
 
     /* Use these functions to lock/unlock our list to prevent concurrent writes
@@ -401,15 +1522,39 @@ sched_monitor_read(struct file * file,
     return length;
 }
 
+/* Readable once the flight recorder has frozen, or in streaming mode whenever
+ * entries are queued. Only the flight recorder trigger wakes up pollers.
+ */
+static unsigned int
+sched_monitor_poll(struct file * file,
+                   poll_table  * wait)
+{
+    struct preemption_tracker * tracker = retrieve_tracker_of_process(file);
+    unsigned int mask = 0;
+    unsigned long flags;
+
+    poll_wait(file, &tracker->waitq, wait);
+
+    spin_lock_irqsave(&tracker->lock, flags);
+    if (tracker->ring ? tracker->frozen : !list_empty(&tracker->list)) {
+        mask = POLLIN | POLLRDNORM;
+    }
+    spin_unlock_irqrestore(&tracker->lock, flags);
+
+    return mask;
+}
+
 static struct file_operations
 dev_ops = 
 {
     .owner = THIS_MODULE,
     .open = sched_monitor_open,
     .flush = sched_monitor_flush,
+    .release = sched_monitor_release,
     .unlocked_ioctl = sched_monitor_ioctl,
     .compat_ioctl = sched_monitor_ioctl,
     .read = sched_monitor_read,
+    .poll = sched_monitor_poll,
 };
 
 static struct miscdevice
@@ -436,8 +1581,22 @@ sched_monitor_init(void)
         return status;
     }
 
+#ifdef CONFIG_PREEMPT_NOTIFIERS
     /* Enable preempt notifiers globally */
     preempt_notifier_inc();
+#endif
+
+    for_each_kernel_tracepoint(lookup_tracepoints, NULL);
+    if (!sched_switch_tp) {
+        printk(KERN_WARNING "Could not find sched_switch, only self-tracking through preempt notifiers is available\n");
+    }
+
+    /* Without the wakeup probe everything but time_wait still works */
+    if (!sched_wakeup_tp ||
+        tracepoint_probe_register(sched_wakeup_tp, monitor_sched_wakeup, NULL) != 0) {
+        printk(KERN_WARNING "Could not attach to sched_wakeup, wakeup latency will not be reported\n");
+        sched_wakeup_tp = NULL;
+    }
 
     printk(KERN_INFO "Loaded sched_monitor module. HZ=%d\n", HZ);
 
@@ -447,8 +1606,17 @@ sched_monitor_init(void)
 static void 
 sched_monitor_exit(void)
 {
+    if (sched_wakeup_tp) {
+        tracepoint_probe_unregister(sched_wakeup_tp, monitor_sched_wakeup, NULL);
+        tracepoint_synchronize_unregister();
+    }
+
+#ifdef CONFIG_PREEMPT_NOTIFIERS
     /* Disable preempt notifier globally */
     preempt_notifier_dec();
+    /* wait for free_orphan_rcu() */
+    rcu_barrier_sched();
+#endif
 
     /* Deregister our device file */
     misc_deregister(&dev_handle);
@@ -24,6 +24,7 @@
 #include <sys/stat.h>
 
 #include <sched_monitor.h>
+#include "sched_trace.h"
 
 
 const int num_expected_args = 2;
@@ -31,8 +32,10 @@ const unsigned sqrt_of_UINT32_MAX = 65536;
 
 int main( int argc, char* argv[] ){
     FILE *results;
+    struct sched_trace_writer *trace;
     int fd, status, i, print;
 	preemption_info_t buf;
+	struct tracking_stats stats;
     fd = open(DEV_NAME, O_RDWR);
     if (fd < 0) {
         fprintf(stderr, "Could not open %s: %s\n", DEV_NAME, strerror(errno));
@@ -80,7 +83,13 @@ int main( int argc, char* argv[] ){
 
 	}
  
-        fprintf(results, "EVENT, TIME_ON, TIME_OFF, CPU, PREEMPTED_BY ");
+	trace = sched_trace_create("preemptions.trace", SCHED_TRACE_DEFAULT_ROWS);
+	if(trace == NULL){
+		printf("Unable to open output trace: %s \n", strerror(errno));
+		exit(-1);
+	}
+
+        fprintf(results, "EVENT, TIME_STAMP, TIME_ON, TIME_OFF, TIME_WAIT, VOLUNTARY, CPU, PREEMPTED_BY ");
 
 	printf("Generating matrices...\n");
 
@@ -125,18 +134,37 @@ int main( int argc, char* argv[] ){
 	if(print){
 		printf("Event %d\n", i); 
         	printf("\tTime off: %'llu ns. Time on: %'llu ns.\n", buf.time_off,buf.time_on);
+        	printf("\tWaited on runqueue: %'llu ns (%s)\n", buf.time_wait,
+        		buf.voluntary ? "blocked" : "preempted");
         	printf("\tScheduled on core %d\n", buf.cpu);
         	printf("\tPreempted by %s\n", &buf.preempted_by);
 	}
         fprintf(results, "\n%d", i);
+	fprintf(results, ",%llu", buf.time_stamp);
 	fprintf(results, ",%llu", buf.time_on);
 	fprintf(results, ",%llu", buf.time_off);
+	fprintf(results, ",%llu", buf.time_wait);
+	fprintf(results, ",%d", buf.voluntary);
 	fprintf(results, ",%d", buf.cpu);
 	fprintf(results, ",%s", &buf.preempted_by);
+	if(trace && sched_trace_append(trace, &buf) < 0){
+		printf("Unable to write output trace: %s \n", strerror(errno));
+		/* the writer refuses further rows, just release it */
+		sched_trace_finish(trace);
+		trace = NULL;
+	}
         ++i;
     }   
 
-    close(results);
+    /* events lost to failed GFP_ATOMIC allocations in the module */
+    if(get_tracking_stats(fd, &stats) == 0 && stats.dropped){
+	fprintf(stderr, "Warning: %s dropped %llu events, the output is incomplete\n", DEV_NAME, stats.dropped);
+    }
+
+    fclose(results);
+    if(trace && sched_trace_finish(trace) < 0){
+	printf("Unable to finish output trace: %s \n", strerror(errno));
+    }
     close(fd);
 
 	return 0;
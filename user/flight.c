@@ -0,0 +1,157 @@
+/******************************************************************************
+*
+* flight.c
+*
+* Runs a command with /dev/sched_monitor in flight recorder mode. Only the last
+* events are kept in the kernel; whenever the command waits on the runqueue for
+* longer than the threshold, the events around that stall are dumped and the
+* recorder is re-armed. Time the command spends blocked is not a stall.
+*
+* Usage: ./flight [-n capacity] [-t threshold_us] [-m post_trigger] [-c count]
+*                 -- cmd args
+*
+*        -n  events kept in the kernel (default 1024)
+*        -t  runqueue wait that triggers a dump, in us (default 2000)
+*        -m  events recorded after the trigger (default 16)
+*        -c  stop after this many dumps, 0 for no limit (default 0)
+*
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <sched_monitor.h>
+
+static void
+dump_events(int                fd,
+            unsigned long long threshold,
+            int                nr)
+{
+    preemption_info_t buf;
+    int i = 1;
+
+    printf("Stall %d\n", nr);
+    while (read(fd, &buf, sizeof(buf)) > 0) {
+        printf("%c Event %d: at %llu ns, off %llu us (waited %llu us, %s), then on %llu us, core %d, preempted by %.16s\n",
+            buf.time_wait >= threshold ? '*' : ' ', i, buf.time_stamp,
+            buf.time_off / 1000, buf.time_wait / 1000, buf.voluntary ? "blocked" : "preempted",
+            buf.time_on / 1000, buf.cpu, buf.preempted_by);
+        ++i;
+    }
+    fflush(stdout);
+}
+
+int
+main(int     argc,
+     char ** argv)
+{
+    struct flight_recorder_config config;
+    struct pollfd pfd;
+    pid_t child;
+    int fd, opt, status, dumps = 0, max_dumps = 0, exited = 0;
+
+    config.capacity = 1024;
+    config.post_trigger = 16;
+    config.threshold = 2000 * 1000ULL;
+
+    while ((opt = getopt(argc, argv, "+n:t:m:c:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                config.capacity = atoi(optarg);
+                break;
+            case 't':
+                config.threshold = strtoull(optarg, NULL, 0) * 1000;
+                break;
+            case 'm':
+                config.post_trigger = atoi(optarg);
+                break;
+            case 'c':
+                max_dumps = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n capacity] [-t threshold_us] [-m post_trigger] [-c count] -- cmd args\n",
+                    argv[0]);
+                return -1;
+        }
+    }
+
+    if (optind >= argc || config.capacity == 0) {
+        fprintf(stderr, "Expected a command to run and a non-zero capacity\n");
+        return -1;
+    }
+
+    fd = open(DEV_NAME, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s: %s\n", DEV_NAME, strerror(errno));
+        return -1;
+    }
+
+    if (configure_flight_recorder(fd, &config) < 0) {
+        fprintf(stderr, "Could not configure flight recorder on %s: %s\n", DEV_NAME, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    /* The child shares our file, enables tracking on itself and becomes the
+     * command; we stay behind to wait for triggers.
+     */
+    child = fork();
+    if (child < 0) {
+        fprintf(stderr, "Could not fork: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (child == 0) {
+        if (enable_preemption_tracking(fd) < 0) {
+            fprintf(stderr, "Could not enable preemption tracking on %s: %s\n", DEV_NAME, strerror(errno));
+            _exit(127);
+        }
+        execvp(argv[optind], &argv[optind]);
+        fprintf(stderr, "Could not execute %s: %s\n", argv[optind], strerror(errno));
+        _exit(127);
+    }
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    while (!exited) {
+        if (poll(&pfd, 1, 100) < 0 && errno != EINTR) {
+            fprintf(stderr, "Could not poll %s: %s\n", DEV_NAME, strerror(errno));
+            break;
+        }
+
+        exited = waitpid(child, &status, WNOHANG) == child;
+
+        if (pfd.revents & POLLIN) {
+            dump_events(fd, config.threshold, ++dumps);
+            if (max_dumps && dumps == max_dumps) {
+                break;
+            }
+            if (!exited && arm_flight_recorder(fd) < 0) {
+                fprintf(stderr, "Could not re-arm flight recorder on %s: %s\n", DEV_NAME, strerror(errno));
+                break;
+            }
+        }
+    }
+
+    if (!exited) {
+        kill(child, SIGTERM);
+        waitpid(child, &status, 0);
+    }
+
+    close(fd);
+
+    printf("Recorded %d stall(s) over %llu us\n", dumps, config.threshold / 1000);
+
+    return 0;
+}
@@ -10,19 +10,135 @@
 
 #include <sched_monitor.h>
 
+/* log2 histogram buckets, in microseconds: [0,1), [1,2), [2,4), ... */
+#define HIST_BUCKETS 24
+
+static int
+hist_bucket(unsigned long long ns)
+{
+    unsigned long long us = ns / 1000;
+    int b = 0;
+
+    while (us && b < HIST_BUCKETS - 1) {
+        us >>= 1;
+        b++;
+    }
+    return b;
+}
+
+static void
+print_histograms(unsigned long hist_off[HIST_BUCKETS],
+                 unsigned long hist_wait[HIST_BUCKETS])
+{
+    int b, last = 0;
+
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        if (hist_off[b] || hist_wait[b])
+            last = b;
+    }
+
+    printf("\n%22s %10s %10s\n", "range (us)", "time_off", "time_wait");
+    for (b = 0; b <= last; b++) {
+        printf("%10llu - %-9llu %10lu %10lu\n",
+            b ? 1ULL << (b - 1) : 0ULL, 1ULL << b, hist_off[b], hist_wait[b]);
+    }
+}
+
+static void
+print_event(const preemption_info_t * buf,
+            int                       i)
+{
+	printf("Event %d (task %d)\n", i, buf->pid);
+	printf("\tTime off: %llu us. Time on: %llu us.\n", (buf->time_off/1000), (buf->time_on/1000));
+	printf("\tWaited on runqueue: %llu us (%s)\n", (buf->time_wait/1000),
+		buf->voluntary ? "blocked" : "preempted");
+	printf("\tScheduled on core %d\n", buf->cpu);
+ 	printf("\tPreempted by %.16s\n", buf->preempted_by);
+}
+
+/* Read everything queued so far, returns the number of the next event */
+static int
+drain(int           fd,
+      int           i,
+      int           quiet,
+      unsigned long hist_off[HIST_BUCKETS],
+      unsigned long hist_wait[HIST_BUCKETS])
+{
+	preemption_info_t buf;
+
+	while(read(fd, &buf, sizeof(buf)) > 0) {
+		if(!quiet) {
+			print_event(&buf, i);
+		}
+		hist_off[hist_bucket(buf.time_off)]++;
+		hist_wait[hist_bucket(buf.time_wait)]++;
+		++i;
+	}
+
+	return i;
+}
+
+/*
+ * Usage: ./monitor [-p pid | -g cgroup_dir | -a] [-d seconds] [-q]
+ *
+ *        Without a target the monitor tracks itself while sleeping. -p tracks
+ *        all threads of a process, -g every task in a cgroup (v2) and -a the
+ *        whole system; these need root. -q only prints the histograms.
+ */
 int 
 main(int     argc,
      char ** argv)
 {
 
-    int fd, status, i;
-	preemption_info_t buf;
+    int fd, status, i, opt, seconds = 3, quiet = 0;
+    int target = TRACK_SELF, id = 0, cgroup_fd = -1, tick;
+	unsigned long hist_off[HIST_BUCKETS] = { 0 };
+	unsigned long hist_wait[HIST_BUCKETS] = { 0 };
+
+    while ((opt = getopt(argc, argv, "p:g:ad:qh")) != -1) {
+        switch (opt) {
+            case 'p':
+                target = TRACK_PID;
+                id = atoi(optarg);
+                break;
+            case 'g':
+                cgroup_fd = open(optarg, O_RDONLY | O_DIRECTORY);
+                if (cgroup_fd < 0) {
+                    fprintf(stderr, "Could not open cgroup %s: %s\n", optarg, strerror(errno));
+                    return -1;
+                }
+                target = TRACK_CGROUP;
+                id = cgroup_fd;
+                break;
+            case 'a':
+                target = TRACK_SYSTEM;
+                break;
+            case 'd':
+                seconds = atoi(optarg);
+                break;
+            case 'q':
+                quiet = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-p pid | -g cgroup_dir | -a] [-d seconds] [-q]\n", argv[0]);
+                return -1;
+        }
+    }
 
     fd = open(DEV_NAME, O_RDWR);
     if (fd < 0) {
         fprintf(stderr, "Could not open %s: %s\n", DEV_NAME, strerror(errno));
         return -1;
     }
+
+    if (target != TRACK_SELF) {
+        status = set_tracking_target(fd, target, id);
+        if (status < 0) {
+            fprintf(stderr, "Could not set tracking target on %s: %s\n", DEV_NAME, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
     
     status = enable_preemption_tracking(fd);
     if (status < 0) {
@@ -30,7 +146,17 @@ main(int     argc,
         close(fd);
         return -1;
     }
-    sleep(3);
+
+	/* Other targets can produce events much faster than we do, so drain
+	 * them as we go instead of letting the kernel queue grow.
+	 */
+	i = 1;
+	for(tick = 0; tick < seconds * 10; tick++) {
+		usleep(100000);
+		if(target != TRACK_SELF) {
+			i = drain(fd, i, quiet, hist_off, hist_wait);
+		}
+	}
 
     status = disable_preemption_tracking(fd);
     if (status < 0) {
@@ -38,16 +164,15 @@ main(int     argc,
         close(fd);
         return -1;
     }
-	i = 1;
-	while(read(fd, &buf, sizeof(buf)) > 0) {
-		printf("Event %d\n", i);
-		printf("\tTime off: %llu ms. Time on: %llu ms.\n", (buf.time_off/1000), (buf.time_on/1000));
-		printf("\tScheduled on core %d\n", buf.cpu);
-	 	printf("\tPreempted by %s\n", &buf.preempted_by);
-		++i;
-	}
+
+	i = drain(fd, i, quiet, hist_off, hist_wait);
+
+	print_histograms(hist_off, hist_wait);
 	
     close(fd);
+    if (cgroup_fd >= 0) {
+        close(cgroup_fd);
+    }
 
     printf("Monitor ran to completion!\n");
 
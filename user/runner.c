@@ -0,0 +1,738 @@
+/******************************************************************************
+*
+* runner.c
+*
+* Runs the same command under several scheduling configurations, repeats each
+* configuration a number of times, and prints a statistical comparison of the
+* preemptions recorded through /dev/sched_monitor.
+*
+* Usage: ./runner [-r repeats] [-q] -c "<config>" [-c "<config>" ...] -- cmd args
+*
+*        Each config is a whitespace separated list of key=value pairs:
+*            name=<label>          label printed in the report
+*            cpus=<list>           CPU affinity, e.g. 0 or 0,2 or 1-3
+*            nice=<n>              nice value
+*            policy=<p>            other, batch, idle, fifo or rr
+*            prio=<n>              priority for fifo/rr (default 1)
+*            noise=<cmd>           noisy neighbour started for each run
+*            noise_count=<n>       number of noisy neighbours (default 1)
+*
+*        An empty config ("") runs the command unmodified.
+*
+*        Runs are interleaved across configurations so that slow drift on the
+*        machine affects every configuration alike.
+*
+*        Preemptions (the task was runnable when switched out) and blocking
+*        switches (it slept) are counted separately.
+*
+*        Preempt notifiers are not inherited across clone(), so without root
+*        only the first thread of the command is followed. As root every
+*        thread of the command is followed through TRACK_PID.
+*
+******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <math.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include <sched_monitor.h>
+
+#define MAX_CONFIGS 16
+#define MAX_NOISE   64
+
+/* how often the descriptor is drained while the command runs */
+#define DRAIN_INTERVAL_US   10000
+
+struct run_config {
+    const char * name;
+    cpu_set_t    cpus;
+    int          has_cpus;
+    int          nice;
+    int          has_nice;
+    int          policy;
+    int          has_policy;
+    int          prio;
+    char       * noise;
+    int          noise_count;
+};
+
+/* Results of a single run of the command */
+struct run_result {
+    double             wall;        /* seconds */
+    unsigned long      preemptions;
+    unsigned long      blocks;      /* voluntary switches */
+    unsigned long      migrations;
+    unsigned long long time_on;     /* total ns on-CPU between preemptions */
+};
+
+/* Growable array of durations, pooled over all runs of a configuration */
+struct samples {
+    unsigned long long * v;
+    unsigned long        n;
+    unsigned long        cap;
+};
+
+struct config_results {
+    struct run_result * runs;
+    unsigned            nr_runs;
+    struct samples      time_off;   /* off-CPU time per preemption */
+    struct samples      time_wait;  /* runqueue wait per switch */
+};
+
+static void
+usage(const char * prog)
+{
+    fprintf(stderr, "Usage: %s [-r repeats] [-q] -c \"<config>\" [-c \"<config>\" ...] -- cmd args\n", prog);
+    fprintf(stderr, "       config keys: name= cpus= nice= policy= prio= noise= noise_count=\n");
+}
+
+static int
+parse_cpus(const char * list,
+           cpu_set_t  * set)
+{
+    char * copy, * tok, * save;
+    int lo, hi;
+
+    CPU_ZERO(set);
+    copy = strdup(list);
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (sscanf(tok, "%d-%d", &lo, &hi) != 2) {
+            if (sscanf(tok, "%d", &lo) != 1) {
+                free(copy);
+                return -1;
+            }
+            hi = lo;
+        }
+        for (; lo <= hi; lo++) {
+            CPU_SET(lo, set);
+        }
+    }
+    free(copy);
+    return 0;
+}
+
+static int
+parse_policy(const char * name)
+{
+    if (!strcmp(name, "other"))
+        return SCHED_OTHER;
+    if (!strcmp(name, "batch"))
+        return SCHED_BATCH;
+    if (!strcmp(name, "idle"))
+        return SCHED_IDLE;
+    if (!strcmp(name, "fifo"))
+        return SCHED_FIFO;
+    if (!strcmp(name, "rr"))
+        return SCHED_RR;
+    return -1;
+}
+
+static int
+parse_config(char              * spec,
+             struct run_config * cfg)
+{
+    char * tok, * save, * value;
+
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->name = spec[0] ? strdup(spec) : "default";
+    cfg->prio = 1;
+    cfg->noise_count = 1;
+
+    for (tok = strtok_r(spec, " \t", &save); tok; tok = strtok_r(NULL, " \t", &save)) {
+        value = strchr(tok, '=');
+        if (!value) {
+            fprintf(stderr, "Malformed config option '%s'\n", tok);
+            return -1;
+        }
+        *value++ = '\0';
+
+        if (!strcmp(tok, "name")) {
+            cfg->name = value;
+        } else if (!strcmp(tok, "cpus")) {
+            if (parse_cpus(value, &cfg->cpus) < 0) {
+                fprintf(stderr, "Malformed cpu list '%s'\n", value);
+                return -1;
+            }
+            cfg->has_cpus = 1;
+        } else if (!strcmp(tok, "nice")) {
+            cfg->nice = atoi(value);
+            cfg->has_nice = 1;
+        } else if (!strcmp(tok, "policy")) {
+            cfg->policy = parse_policy(value);
+            if (cfg->policy < 0) {
+                fprintf(stderr, "Unknown scheduling policy '%s'\n", value);
+                return -1;
+            }
+            cfg->has_policy = 1;
+        } else if (!strcmp(tok, "prio")) {
+            cfg->prio = atoi(value);
+        } else if (!strcmp(tok, "noise")) {
+            cfg->noise = value;
+        } else if (!strcmp(tok, "noise_count")) {
+            cfg->noise_count = atoi(value);
+            if (cfg->noise_count < 0 || cfg->noise_count > MAX_NOISE) {
+                fprintf(stderr, "noise_count must be between 0 and %d\n", MAX_NOISE);
+                return -1;
+            }
+        } else {
+            fprintf(stderr, "Unknown config option '%s'\n", tok);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Apply a configuration to the calling process. Called in the child between
+ * fork and exec, so the settings are inherited by the command.
+ */
+static int
+apply_config(const struct run_config * cfg)
+{
+    struct sched_param param;
+
+    if (cfg->has_cpus && sched_setaffinity(0, sizeof(cfg->cpus), &cfg->cpus) < 0) {
+        fprintf(stderr, "Could not set CPU affinity: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (cfg->has_nice && setpriority(PRIO_PROCESS, 0, cfg->nice) < 0) {
+        fprintf(stderr, "Could not set nice value: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (cfg->has_policy) {
+        memset(&param, 0, sizeof(param));
+        if (cfg->policy == SCHED_FIFO || cfg->policy == SCHED_RR) {
+            param.sched_priority = cfg->prio;
+        }
+        if (sched_setscheduler(0, cfg->policy, &param) < 0) {
+            fprintf(stderr, "Could not set scheduling policy: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static pid_t
+spawn_noise(const char * cmd)
+{
+    pid_t pid;
+    int devnull;
+
+    pid = fork();
+    if (pid == 0) {
+        /* own process group, so the whole neighbour can be killed at once */
+        setpgid(0, 0);
+        devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0) {
+            dup2(devnull, STDOUT_FILENO);
+            close(devnull);
+        }
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+    if (pid > 0) {
+        setpgid(pid, pid);
+    }
+    return pid;
+}
+
+/* Kill and reap the noisy neighbours started by spawn_noise() */
+static void
+stop_noise(pid_t * noise,
+           int     nr_noise)
+{
+    int i;
+
+    for (i = 0; i < nr_noise; i++) {
+        if (noise[i] > 0) {
+            kill(-noise[i], SIGKILL);
+            waitpid(noise[i], NULL, 0);
+        }
+    }
+}
+
+static void
+add_sample(struct samples     * s,
+           unsigned long long   value)
+{
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->v = realloc(s->v, s->cap * sizeof(*s->v));
+        if (!s->v) {
+            fprintf(stderr, "Out of memory\n");
+            exit(-1);
+        }
+    }
+    s->v[s->n++] = value;
+}
+
+/* Drains a descriptor into the results of one run */
+/* enough for the threads of the usual workloads; further threads are
+ * not counted towards migrations
+ */
+#define MAX_THREADS 256
+
+struct last_cpu {
+    int pid;
+    int cpu;
+};
+
+struct drainer {
+    int                     fd;
+    struct last_cpu         last_cpu[MAX_THREADS];
+    int                     nr_threads;
+    int                     stop;
+    struct run_result     * run;
+    struct config_results * res;
+};
+
+/* Entries of different threads interleave, so migrations are counted
+ * against the last CPU of the same thread
+ */
+static void
+count_migration(struct drainer          * d,
+                const preemption_info_t * buf)
+{
+    int i;
+
+    for (i = 0; i < d->nr_threads; i++) {
+        if (d->last_cpu[i].pid == buf->pid) {
+            if (d->last_cpu[i].cpu != buf->cpu) {
+                d->run->migrations++;
+            }
+            d->last_cpu[i].cpu = buf->cpu;
+            return;
+        }
+    }
+
+    if (d->nr_threads < MAX_THREADS) {
+        d->last_cpu[d->nr_threads].pid = buf->pid;
+        d->last_cpu[d->nr_threads].cpu = buf->cpu;
+        d->nr_threads++;
+    }
+}
+
+static void
+drain(struct drainer * d)
+{
+    preemption_info_t buf;
+
+    while (read(d->fd, &buf, sizeof(buf)) > 0) {
+        d->run->time_on += buf.time_on;
+        count_migration(d, &buf);
+        add_sample(&d->res->time_wait, buf.time_wait);
+
+        /* time off the CPU after blocking is sleep, not contention */
+        if (buf.voluntary) {
+            d->run->blocks++;
+            continue;
+        }
+        d->run->preemptions++;
+        add_sample(&d->res->time_off, buf.time_off);
+    }
+}
+
+/* Through TRACK_PID the module keeps at most MAX_PREEMPTS unread entries,
+ * and the notifier queue grows with the run, so the descriptor is drained
+ * while the command is still running.
+ */
+static void *
+drain_thread(void * arg)
+{
+    struct drainer * d = arg;
+
+    while (!__atomic_load_n(&d->stop, __ATOMIC_ACQUIRE)) {
+        drain(d);
+        usleep(DRAIN_INTERVAL_US);
+    }
+    return NULL;
+}
+
+/* Run the command once under 'cfg'. The parent opens the device and the child
+ * inherits it, enables tracking on itself and then execs the command, so the
+ * preemptions of the command are readable from the parent while it runs and
+ * after it exits. As root the parent instead tracks the child's process
+ * through TRACK_PID, which also covers the threads the command starts; the
+ * child waits on 'go' until tracking is enabled.
+ */
+static int
+run_once(const struct run_config * cfg,
+         char                   ** cmd,
+         int                       quiet,
+         struct config_results   * res)
+{
+    struct run_result * run = &res->runs[res->nr_runs];
+    struct timespec begin, end;
+    pid_t noise[MAX_NOISE];
+    pid_t child;
+    pthread_t drainer_thread;
+    struct drainer drainer;
+    struct tracking_stats stats;
+    int fd, status, nr_noise = 0;
+    int by_pid = geteuid() == 0;
+    int go[2];
+    char c = 0;
+
+    fd = open(DEV_NAME, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s: %s\n", DEV_NAME, strerror(errno));
+        return -1;
+    }
+
+    if (by_pid && pipe(go) < 0) {
+        fprintf(stderr, "Could not create pipe: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (cfg->noise) {
+        for (nr_noise = 0; nr_noise < cfg->noise_count; nr_noise++) {
+            noise[nr_noise] = spawn_noise(cfg->noise);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    child = fork();
+    if (child < 0) {
+        fprintf(stderr, "Could not fork: %s\n", strerror(errno));
+        stop_noise(noise, nr_noise);
+        if (by_pid) {
+            close(go[0]);
+            close(go[1]);
+        }
+        close(fd);
+        return -1;
+    }
+
+    if (child == 0) {
+        if (quiet) {
+            int devnull = open("/dev/null", O_WRONLY);
+            if (devnull >= 0) {
+                dup2(devnull, STDOUT_FILENO);
+                close(devnull);
+            }
+        }
+
+        if (apply_config(cfg) < 0) {
+            _exit(126);
+        }
+
+        if (by_pid) {
+            close(go[1]);
+            /* EOF without a byte means the parent could not enable tracking */
+            if (read(go[0], &c, 1) != 1) {
+                _exit(126);
+            }
+            close(go[0]);
+        } else if (enable_preemption_tracking(fd) < 0) {
+            fprintf(stderr, "Could not enable preemption tracking on %s: %s\n", DEV_NAME, strerror(errno));
+            _exit(126);
+        }
+
+        execvp(cmd[0], cmd);
+        fprintf(stderr, "Could not execute %s: %s\n", cmd[0], strerror(errno));
+        _exit(127);
+    }
+
+    if (by_pid) {
+        close(go[0]);
+        if (set_tracking_target(fd, TRACK_PID, child) < 0 || enable_preemption_tracking(fd) < 0) {
+            fprintf(stderr, "Could not track process %d on %s: %s\n", child, DEV_NAME, strerror(errno));
+        } else {
+            write(go[1], &c, 1);
+        }
+        close(go[1]);
+    }
+
+    memset(run, 0, sizeof(*run));
+    drainer.fd = fd;
+    drainer.nr_threads = 0;
+    drainer.stop = 0;
+    drainer.run = run;
+    drainer.res = res;
+    pthread_create(&drainer_thread, NULL, drain_thread, &drainer);
+
+    waitpid(child, &status, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    __atomic_store_n(&drainer.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(drainer_thread, NULL);
+
+    stop_noise(noise, nr_noise);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) == 126 || WEXITSTATUS(status) == 127) {
+        fprintf(stderr, "Command failed under config '%s'\n", cfg->name);
+        close(fd);
+        return -1;
+    }
+
+    run->wall = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    /* hands the entries still pending in the module over to read() */
+    if (by_pid) {
+        disable_preemption_tracking(fd);
+    }
+    drain(&drainer);
+
+    /* counts and percentiles would silently be truncated */
+    if (get_tracking_stats(fd, &stats) == 0 && stats.dropped) {
+        fprintf(stderr, "%s dropped %llu events under config '%s'\n", DEV_NAME, stats.dropped, cfg->name);
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    res->nr_runs++;
+    return 0;
+}
+
+static int
+compare_ull(const void * a,
+            const void * b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+static unsigned long long
+percentile(const struct samples * sorted,
+           double                 p)
+{
+    unsigned long idx;
+
+    if (sorted->n == 0)
+        return 0;
+    idx = (unsigned long)(p * (sorted->n - 1) + 0.5);
+    return sorted->v[idx];
+}
+
+static void
+print_percentiles(const char            * title,
+                  struct run_config     * cfgs,
+                  struct config_results * results,
+                  int                     nr_cfgs,
+                  size_t                  offset)
+{
+    const struct samples * s;
+    int c;
+
+    printf("\n%s (us)\n", title);
+    printf("%-20s %10s %10s %10s %10s %10s\n", "config", "samples", "p50", "p90", "p99", "max");
+    for (c = 0; c < nr_cfgs; c++) {
+        s = (const struct samples *)((const char *)&results[c] + offset);
+        printf("%-20.20s %10lu %10.1f %10.1f %10.1f %10.1f\n", cfgs[c].name, s->n,
+            percentile(s, 0.50) / 1e3,
+            percentile(s, 0.90) / 1e3,
+            percentile(s, 0.99) / 1e3,
+            percentile(s, 1.00) / 1e3);
+    }
+}
+
+/* Two-sided 95% critical values of Student's t for 1..30 degrees of freedom */
+static const double t_95[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+};
+
+/* Mean and half-width of the 95% confidence interval of the mean */
+static void
+mean_ci(const double * samples,
+        unsigned       n,
+        double       * mean,
+        double       * ci)
+{
+    double sum = 0, var = 0;
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        sum += samples[i];
+    }
+    *mean = n ? sum / n : 0;
+
+    if (n < 2) {
+        *ci = 0;
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        var += (samples[i] - *mean) * (samples[i] - *mean);
+    }
+    var /= n - 1;
+
+    *ci = (n - 1 <= 30 ? t_95[n - 2] : 1.960) * sqrt(var / n);
+}
+
+enum metric { WALL, PREEMPTIONS, RATE, BLOCKS, MIGRATIONS, TIME_ON, NR_METRICS };
+
+static double
+metric_of(const struct run_result * run,
+          enum metric               m)
+{
+    switch (m) {
+        case WALL:        return run->wall;
+        case PREEMPTIONS: return run->preemptions;
+        case RATE:        return run->wall > 0 ? run->preemptions / run->wall : 0;
+        case BLOCKS:      return run->blocks;
+        case MIGRATIONS:  return run->migrations;
+        case TIME_ON:     return run->time_on / 1e9;
+        default:          return 0;
+    }
+}
+
+static void
+report(struct run_config     * cfgs,
+       struct config_results * results,
+       int                     nr_cfgs,
+       unsigned                repeats)
+{
+    static const char * metric_names[NR_METRICS] = {
+        "wall time (s)", "preemptions", "preemptions/s", "blocking switches", "migrations",
+        "on-CPU time (s)"
+    };
+    double * samples = malloc(repeats * sizeof(double));
+    double mean[MAX_CONFIGS][NR_METRICS], ci[MAX_CONFIGS][NR_METRICS];
+    struct config_results * res;
+    unsigned i;
+    int c, m;
+
+    for (c = 0; c < nr_cfgs; c++) {
+        res = &results[c];
+        for (m = 0; m < NR_METRICS; m++) {
+            for (i = 0; i < res->nr_runs; i++) {
+                samples[i] = metric_of(&res->runs[i], m);
+            }
+            mean_ci(samples, res->nr_runs, &mean[c][m], &ci[c][m]);
+        }
+        qsort(res->time_off.v, res->time_off.n, sizeof(*res->time_off.v), compare_ull);
+        qsort(res->time_wait.v, res->time_wait.n, sizeof(*res->time_wait.v), compare_ull);
+    }
+    free(samples);
+
+    printf("\n%-20s %5s", "config", "runs");
+    for (m = 0; m < NR_METRICS; m++) {
+        printf("  %24s", metric_names[m]);
+    }
+    printf("\n");
+
+    for (c = 0; c < nr_cfgs; c++) {
+        printf("%-20.20s %5u", cfgs[c].name, results[c].nr_runs);
+        for (m = 0; m < NR_METRICS; m++) {
+            printf("  %12.3f +/- %-8.3f", mean[c][m], ci[c][m]);
+        }
+        printf("\n");
+    }
+
+    print_percentiles("Off-CPU time per preemption", cfgs, results, nr_cfgs,
+        offsetof(struct config_results, time_off));
+    print_percentiles("Runqueue wait per switch", cfgs, results, nr_cfgs,
+        offsetof(struct config_results, time_wait));
+
+    if (nr_cfgs < 2 || mean[0][WALL] == 0)
+        return;
+
+    /* Relative change against the first configuration. A difference is
+     * flagged when the confidence intervals of the two means do not overlap.
+     */
+    printf("\nChange relative to '%s'\n", cfgs[0].name);
+    printf("%-20s", "config");
+    for (m = 0; m < NR_METRICS; m++) {
+        printf("  %24s", metric_names[m]);
+    }
+    printf("\n");
+    for (c = 1; c < nr_cfgs; c++) {
+        printf("%-20.20s", cfgs[c].name);
+        for (m = 0; m < NR_METRICS; m++) {
+            int significant = fabs(mean[c][m] - mean[0][m]) > ci[c][m] + ci[0][m];
+            if (mean[0][m] == 0) {
+                printf("  %24s", "n/a");
+            } else {
+                printf("  %+22.1f%%%c", 100.0 * (mean[c][m] - mean[0][m]) / mean[0][m],
+                    significant ? '*' : ' ');
+            }
+        }
+        printf("\n");
+    }
+    printf("(* 95%% confidence intervals do not overlap)\n");
+}
+
+int
+main(int     argc,
+     char ** argv)
+{
+    struct run_config cfgs[MAX_CONFIGS];
+    struct config_results results[MAX_CONFIGS];
+    unsigned repeats = 5, r;
+    int nr_cfgs = 0, quiet = 0, opt, c;
+
+    while ((opt = getopt(argc, argv, "+r:c:qh")) != -1) {
+        switch (opt) {
+            case 'r':
+                repeats = atoi(optarg);
+                break;
+            case 'c':
+                if (nr_cfgs == MAX_CONFIGS) {
+                    fprintf(stderr, "At most %d configurations are supported\n", MAX_CONFIGS);
+                    return -1;
+                }
+                if (parse_config(optarg, &cfgs[nr_cfgs]) < 0) {
+                    return -1;
+                }
+                nr_cfgs++;
+                break;
+            case 'q':
+                quiet = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (optind >= argc || repeats == 0) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if (nr_cfgs == 0) {
+        parse_config(strdup(""), &cfgs[nr_cfgs++]);
+    }
+
+    memset(results, 0, sizeof(results));
+    for (c = 0; c < nr_cfgs; c++) {
+        results[c].runs = calloc(repeats, sizeof(struct run_result));
+    }
+
+    for (r = 0; r < repeats; r++) {
+        for (c = 0; c < nr_cfgs; c++) {
+            printf("Run %u/%u, config '%s'\n", r + 1, repeats, cfgs[c].name);
+            fflush(stdout);
+            if (run_once(&cfgs[c], &argv[optind], quiet, &results[c]) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    report(cfgs, results, nr_cfgs, repeats);
+
+    return 0;
+}
@@ -0,0 +1,586 @@
+/******************************************************************************
+*
+* sched_trace.c
+*
+* Writer and reader for the columnar preemption trace format described in
+* sched_trace.h.
+*
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "sched_trace.h"
+
+#define BLOCK_ALIGN 4096
+
+static const size_t column_width[SCHED_TRACE_NR_COLUMNS] = {
+    [SCHED_TRACE_COL_TIME_STAMP] = sizeof(uint64_t),
+    [SCHED_TRACE_COL_TIME_ON]    = sizeof(uint64_t),
+    [SCHED_TRACE_COL_TIME_OFF]   = sizeof(uint64_t),
+    [SCHED_TRACE_COL_TIME_WAIT]  = sizeof(uint64_t),
+    [SCHED_TRACE_COL_CPU]        = sizeof(int32_t),
+    [SCHED_TRACE_COL_PREEMPTOR]  = sizeof(uint32_t),
+    [SCHED_TRACE_COL_PID]        = sizeof(int32_t),
+    [SCHED_TRACE_COL_VOLUNTARY]  = sizeof(uint8_t),
+};
+
+/* Offset of a column from the start of its block */
+static size_t
+column_offset(unsigned block_rows,
+              int      column)
+{
+    size_t offset = 0;
+    int c;
+
+    for (c = 0; c < column; c++) {
+        offset += column_width[c] * block_rows;
+    }
+    return offset;
+}
+
+static size_t
+block_size(unsigned block_rows)
+{
+    size_t size = column_offset(block_rows, SCHED_TRACE_NR_COLUMNS);
+    return (size + BLOCK_ALIGN - 1) & ~(size_t)(BLOCK_ALIGN - 1);
+}
+
+/*** Writer ***/
+
+struct sched_trace_writer {
+    int      fd;
+    unsigned block_rows;
+    unsigned nr_rows;              /* rows in the current block */
+    uint64_t total_rows;
+    uint64_t offset;               /* where the next block goes */
+    int      error;                /* errno of the first failed write, 0 if none */
+
+    /* current block, laid out exactly as on disk */
+    unsigned char * block;
+
+    struct sched_trace_block_index * index;
+    unsigned nr_blocks;
+    unsigned cap_blocks;
+
+    /* preemptor dictionary, with an open addressing hash for lookups */
+    char     (* names)[SCHED_TRACE_NAME_LEN];
+    uint32_t    nr_names;
+    uint32_t    cap_names;
+    uint32_t  * hash;              /* id + 1, 0 for empty */
+    uint32_t    hash_size;
+};
+
+static uint32_t
+hash_name(const char * name)
+{
+    uint32_t h = 2166136261u;
+    int i;
+
+    for (i = 0; i < SCHED_TRACE_NAME_LEN && name[i]; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+static int
+grow_hash(struct sched_trace_writer * writer)
+{
+    uint32_t size = writer->hash_size ? writer->hash_size * 2 : 256;
+    uint32_t * hash = calloc(size, sizeof(*hash));
+    uint32_t id, h;
+
+    if (!hash)
+        return -1;
+
+    for (id = 0; id < writer->nr_names; id++) {
+        h = hash_name(writer->names[id]) & (size - 1);
+        while (hash[h])
+            h = (h + 1) & (size - 1);
+        hash[h] = id + 1;
+    }
+
+    free(writer->hash);
+    writer->hash = hash;
+    writer->hash_size = size;
+    return 0;
+}
+
+static int64_t
+lookup_name(struct sched_trace_writer * writer,
+            const char                * name)
+{
+    char key[SCHED_TRACE_NAME_LEN];
+    uint32_t h, id;
+
+    /* compare on the full, zero padded width */
+    memset(key, 0, sizeof(key));
+    strncpy(key, name, sizeof(key));
+
+    if ((writer->nr_names + 1) * 2 > writer->hash_size && grow_hash(writer) < 0)
+        return -1;
+
+    h = hash_name(key) & (writer->hash_size - 1);
+    while (writer->hash[h]) {
+        id = writer->hash[h] - 1;
+        if (!memcmp(writer->names[id], key, sizeof(key)))
+            return id;
+        h = (h + 1) & (writer->hash_size - 1);
+    }
+
+    if (writer->nr_names == writer->cap_names) {
+        uint32_t cap = writer->cap_names ? writer->cap_names * 2 : 64;
+        void * names = realloc(writer->names, cap * sizeof(*writer->names));
+        if (!names)
+            return -1;
+        writer->names = names;
+        writer->cap_names = cap;
+    }
+
+    id = writer->nr_names++;
+    memcpy(writer->names[id], key, sizeof(key));
+    writer->hash[h] = id + 1;
+    return id;
+}
+
+static int
+write_all(int          fd,
+          const void * buf,
+          size_t       len,
+          uint64_t     offset)
+{
+    const unsigned char * p = buf;
+    ssize_t ret;
+
+    while (len) {
+        ret = pwrite(fd, p, len, offset);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+static void *
+writer_column(struct sched_trace_writer * writer,
+              int                         column)
+{
+    return writer->block + column_offset(writer->block_rows, column);
+}
+
+/* Write out the current block and compute its index entry */
+static int
+flush_block(struct sched_trace_writer * writer)
+{
+    const uint64_t * time_stamp = writer_column(writer, SCHED_TRACE_COL_TIME_STAMP);
+    const uint64_t * time_off = writer_column(writer, SCHED_TRACE_COL_TIME_OFF);
+    const uint64_t * time_wait = writer_column(writer, SCHED_TRACE_COL_TIME_WAIT);
+    const int32_t * cpu = writer_column(writer, SCHED_TRACE_COL_CPU);
+    struct sched_trace_block_index * idx;
+    size_t size = block_size(writer->block_rows);
+    unsigned i;
+
+    if (writer->nr_rows == 0)
+        return 0;
+
+    if (writer->nr_blocks == writer->cap_blocks) {
+        unsigned cap = writer->cap_blocks ? writer->cap_blocks * 2 : 64;
+        void * index = realloc(writer->index, cap * sizeof(*writer->index));
+        if (!index)
+            return -1;
+        writer->index = index;
+        writer->cap_blocks = cap;
+    }
+
+    idx = &writer->index[writer->nr_blocks];
+    memset(idx, 0, sizeof(*idx));
+    idx->offset = writer->offset;
+    idx->nr_rows = writer->nr_rows;
+    idx->cpu_min = idx->cpu_max = cpu[0];
+    idx->time_stamp_min = idx->time_stamp_max = time_stamp[0];
+    idx->time_off_min = idx->time_off_max = time_off[0];
+    idx->time_wait_min = idx->time_wait_max = time_wait[0];
+
+    for (i = 0; i < writer->nr_rows; i++) {
+        if (cpu[i] < idx->cpu_min) idx->cpu_min = cpu[i];
+        if (cpu[i] > idx->cpu_max) idx->cpu_max = cpu[i];
+        idx->cpu_mask |= 1ULL << ((unsigned)cpu[i] % 64);
+        if (time_stamp[i] < idx->time_stamp_min) idx->time_stamp_min = time_stamp[i];
+        if (time_stamp[i] > idx->time_stamp_max) idx->time_stamp_max = time_stamp[i];
+        if (time_off[i] < idx->time_off_min) idx->time_off_min = time_off[i];
+        if (time_off[i] > idx->time_off_max) idx->time_off_max = time_off[i];
+        if (time_wait[i] < idx->time_wait_min) idx->time_wait_min = time_wait[i];
+        if (time_wait[i] > idx->time_wait_max) idx->time_wait_max = time_wait[i];
+    }
+
+    /* Unused rows of a short last block are written as zeroes */
+    if (write_all(writer->fd, writer->block, size, writer->offset) < 0)
+        return -1;
+
+    memset(writer->block, 0, size);
+    writer->offset += size;
+    writer->nr_rows = 0;
+    writer->nr_blocks++;
+    return 0;
+}
+
+struct sched_trace_writer *
+sched_trace_create(const char * path,
+                   unsigned     block_rows)
+{
+    struct sched_trace_writer * writer;
+    struct sched_trace_header header;
+
+    if (block_rows == 0 || block_rows % 64) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    writer = calloc(1, sizeof(*writer));
+    if (!writer)
+        return NULL;
+
+    writer->block_rows = block_rows;
+    writer->block = calloc(1, block_size(block_rows));
+    if (!writer->block) {
+        free(writer);
+        return NULL;
+    }
+
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer->fd < 0) {
+        free(writer->block);
+        free(writer);
+        return NULL;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCHED_TRACE_MAGIC, sizeof(header.magic));
+    header.version = SCHED_TRACE_VERSION;
+    header.block_rows = block_rows;
+    header.nr_columns = SCHED_TRACE_NR_COLUMNS;
+
+    if (write_all(writer->fd, &header, sizeof(header), 0) < 0) {
+        close(writer->fd);
+        free(writer->block);
+        free(writer);
+        return NULL;
+    }
+
+    writer->offset = BLOCK_ALIGN;
+    return writer;
+}
+
+int
+sched_trace_append(struct sched_trace_writer * writer,
+                   const preemption_info_t   * info)
+{
+    unsigned row = writer->nr_rows;
+    int64_t id;
+
+    /* after a failed flush the block is still full; refuse further rows */
+    if (writer->error) {
+        errno = writer->error;
+        return -1;
+    }
+
+    id = lookup_name(writer, info->preempted_by);
+    if (id < 0)
+        return -1;
+
+    ((uint64_t *)writer_column(writer, SCHED_TRACE_COL_TIME_STAMP))[row] = info->time_stamp;
+    ((uint64_t *)writer_column(writer, SCHED_TRACE_COL_TIME_ON))[row] = info->time_on;
+    ((uint64_t *)writer_column(writer, SCHED_TRACE_COL_TIME_OFF))[row] = info->time_off;
+    ((uint64_t *)writer_column(writer, SCHED_TRACE_COL_TIME_WAIT))[row] = info->time_wait;
+    ((int32_t *)writer_column(writer, SCHED_TRACE_COL_CPU))[row] = info->cpu;
+    ((uint32_t *)writer_column(writer, SCHED_TRACE_COL_PREEMPTOR))[row] = (uint32_t)id;
+    ((int32_t *)writer_column(writer, SCHED_TRACE_COL_PID))[row] = info->pid;
+    ((uint8_t *)writer_column(writer, SCHED_TRACE_COL_VOLUNTARY))[row] = !!info->voluntary;
+
+    writer->total_rows++;
+    if (++writer->nr_rows == writer->block_rows && flush_block(writer) < 0) {
+        writer->error = errno;
+        return -1;
+    }
+    return 0;
+}
+
+int
+sched_trace_finish(struct sched_trace_writer * writer)
+{
+    struct sched_trace_trailer trailer;
+    int ret = -1;
+
+    if (writer->error) {
+        errno = writer->error;
+        goto out;
+    }
+
+    if (flush_block(writer) < 0)
+        goto out;
+
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.dict_offset = writer->offset;
+    trailer.index_offset = trailer.dict_offset + (uint64_t)writer->nr_names * SCHED_TRACE_NAME_LEN;
+    trailer.nr_rows = writer->total_rows;
+    trailer.nr_blocks = writer->nr_blocks;
+    trailer.nr_names = writer->nr_names;
+    memcpy(trailer.magic, SCHED_TRACE_MAGIC, sizeof(trailer.magic));
+
+    if (write_all(writer->fd, writer->names, (size_t)writer->nr_names * SCHED_TRACE_NAME_LEN,
+                  trailer.dict_offset) < 0)
+        goto out;
+    if (write_all(writer->fd, writer->index, writer->nr_blocks * sizeof(*writer->index),
+                  trailer.index_offset) < 0)
+        goto out;
+    if (write_all(writer->fd, &trailer, sizeof(trailer),
+                  trailer.index_offset + writer->nr_blocks * sizeof(*writer->index)) < 0)
+        goto out;
+
+    ret = 0;
+out:
+    if (close(writer->fd) < 0)
+        ret = -1;
+    free(writer->block);
+    free(writer->index);
+    free(writer->names);
+    free(writer->hash);
+    free(writer);
+    return ret;
+}
+
+/*** Reader ***/
+
+struct sched_trace_reader {
+    const unsigned char * map;
+    size_t                size;
+    const struct sched_trace_header     * header;
+    const struct sched_trace_trailer    * trailer;
+    const struct sched_trace_block_index * index;
+    const char (* names)[SCHED_TRACE_NAME_LEN];
+};
+
+struct sched_trace_reader *
+sched_trace_open(const char * path)
+{
+    struct sched_trace_reader * reader;
+    const struct sched_trace_trailer * trailer;
+    struct stat st;
+    uint64_t i, end;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    if ((size_t)st.st_size < BLOCK_ALIGN + sizeof(struct sched_trace_trailer)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    reader = calloc(1, sizeof(*reader));
+    if (!reader) {
+        close(fd);
+        return NULL;
+    }
+
+    reader->size = st.st_size;
+    reader->map = mmap(NULL, reader->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (reader->map == MAP_FAILED) {
+        free(reader);
+        return NULL;
+    }
+
+    reader->header = (const void *)reader->map;
+    trailer = (const void *)(reader->map + reader->size - sizeof(*trailer));
+    reader->trailer = trailer;
+
+    if (memcmp(reader->header->magic, SCHED_TRACE_MAGIC, sizeof(reader->header->magic)) ||
+        memcmp(trailer->magic, SCHED_TRACE_MAGIC, sizeof(trailer->magic)) ||
+        reader->header->version != SCHED_TRACE_VERSION ||
+        reader->header->nr_columns != SCHED_TRACE_NR_COLUMNS ||
+        reader->header->block_rows == 0 || reader->header->block_rows % 64 ||
+        trailer->dict_offset < BLOCK_ALIGN || trailer->dict_offset > trailer->index_offset ||
+        trailer->index_offset > reader->size ||
+        trailer->dict_offset + (uint64_t)trailer->nr_names * SCHED_TRACE_NAME_LEN != trailer->index_offset ||
+        trailer->index_offset + (uint64_t)trailer->nr_blocks * sizeof(*reader->index)
+            != reader->size - sizeof(*trailer)) {
+        goto invalid;
+    }
+
+    reader->names = (const void *)(reader->map + trailer->dict_offset);
+    reader->index = (const void *)(reader->map + trailer->index_offset);
+
+    for (i = 0; i < trailer->nr_blocks; i++) {
+        end = reader->index[i].offset + block_size(reader->header->block_rows);
+        if (reader->index[i].offset % BLOCK_ALIGN || reader->index[i].offset < BLOCK_ALIGN ||
+            end < reader->index[i].offset || end > trailer->dict_offset ||
+            reader->index[i].nr_rows > reader->header->block_rows) {
+            goto invalid;
+        }
+    }
+
+    /* queries skip most blocks, so readahead is requested per block instead */
+    madvise((void *)reader->map, reader->size, MADV_RANDOM);
+    return reader;
+
+invalid:
+    munmap((void *)reader->map, reader->size);
+    free(reader);
+    errno = EINVAL;
+    return NULL;
+}
+
+void
+sched_trace_close(struct sched_trace_reader * reader)
+{
+    munmap((void *)reader->map, reader->size);
+    free(reader);
+}
+
+uint64_t
+sched_trace_nr_rows(const struct sched_trace_reader * reader)
+{
+    return reader->trailer->nr_rows;
+}
+
+unsigned
+sched_trace_nr_blocks(const struct sched_trace_reader * reader)
+{
+    return reader->trailer->nr_blocks;
+}
+
+int
+sched_trace_get_block(const struct sched_trace_reader * reader,
+                      unsigned                          nr,
+                      struct sched_trace_block        * block)
+{
+    unsigned rows = reader->header->block_rows;
+    const unsigned char * base;
+
+    if (nr >= reader->trailer->nr_blocks) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    block->index = &reader->index[nr];
+    base = reader->map + block->index->offset;
+
+    block->time_stamp = (const void *)(base + column_offset(rows, SCHED_TRACE_COL_TIME_STAMP));
+    block->time_on    = (const void *)(base + column_offset(rows, SCHED_TRACE_COL_TIME_ON));
+    block->time_off   = (const void *)(base + column_offset(rows, SCHED_TRACE_COL_TIME_OFF));
+    block->time_wait  = (const void *)(base + column_offset(rows, SCHED_TRACE_COL_TIME_WAIT));
+    block->cpu        = (const void *)(base + column_offset(rows, SCHED_TRACE_COL_CPU));
+    block->preemptor  = (const void *)(base + column_offset(rows, SCHED_TRACE_COL_PREEMPTOR));
+    block->pid        = (const void *)(base + column_offset(rows, SCHED_TRACE_COL_PID));
+    block->voluntary  = (const void *)(base + column_offset(rows, SCHED_TRACE_COL_VOLUNTARY));
+    return 0;
+}
+
+const char *
+sched_trace_name(const struct sched_trace_reader * reader,
+                 uint32_t                          id)
+{
+    if (id >= reader->trailer->nr_names)
+        return NULL;
+    return reader->names[id];
+}
+
+/* Can any row of the block match? */
+static int
+block_may_match(const struct sched_trace_block_index * idx,
+                const struct sched_trace_query       * query)
+{
+    if (idx->time_stamp_max < query->time_begin || idx->time_stamp_min > query->time_end)
+        return 0;
+    if (idx->time_off_max < query->min_time_off)
+        return 0;
+    if (idx->time_wait_max < query->min_time_wait)
+        return 0;
+    if (query->cpu >= 0) {
+        if (query->cpu < idx->cpu_min || query->cpu > idx->cpu_max)
+            return 0;
+        if (!(idx->cpu_mask & (1ULL << ((unsigned)query->cpu % 64))))
+            return 0;
+    }
+    return 1;
+}
+
+long
+sched_trace_query(const struct sched_trace_reader * reader,
+                  const struct sched_trace_query  * query,
+                  sched_trace_callback              cb,
+                  void                            * arg,
+                  unsigned                        * blocks_scanned)
+{
+    struct sched_trace_block block;
+    preemption_info_t row;
+    const char * name;
+    unsigned b, i, scanned = 0;
+    long matches = 0;
+
+    for (b = 0; b < reader->trailer->nr_blocks; b++) {
+        if (!block_may_match(&reader->index[b], query))
+            continue;
+
+        scanned++;
+        sched_trace_get_block(reader, b, &block);
+        madvise((void *)(reader->map + block.index->offset), block_size(reader->header->block_rows),
+                MADV_WILLNEED);
+
+        for (i = 0; i < block.index->nr_rows; i++) {
+            /* cheapest and usually most selective columns first */
+            if (block.time_off[i] < query->min_time_off ||
+                block.time_stamp[i] < query->time_begin ||
+                block.time_stamp[i] > query->time_end ||
+                block.time_wait[i] < query->min_time_wait ||
+                (query->cpu >= 0 && block.cpu[i] != query->cpu) ||
+                (query->pid >= 0 && block.pid[i] != query->pid)) {
+                continue;
+            }
+
+            matches++;
+            if (!cb)
+                continue;
+
+            memset(&row, 0, sizeof(row));
+            row.cpu = block.cpu[i];
+            row.pid = block.pid[i];
+            row.time_stamp = block.time_stamp[i];
+            row.time_on = block.time_on[i];
+            row.time_off = block.time_off[i];
+            row.time_wait = block.time_wait[i];
+            row.voluntary = block.voluntary[i];
+            name = sched_trace_name(reader, block.preemptor[i]);
+            if (name)
+                memcpy(row.preempted_by, name, sizeof(row.preempted_by));
+
+            if (cb(&row, arg))
+                goto out;
+        }
+    }
+
+out:
+    if (blocks_scanned)
+        *blocks_scanned = scanned;
+    return matches;
+}
@@ -0,0 +1,174 @@
+#ifndef __SCHED_TRACE_H
+#define __SCHED_TRACE_H
+
+/*
+ * Columnar on-disk format for preemption traces.
+ *
+ * Records read from /dev/sched_monitor are stored one column per field in
+ * fixed-size blocks. Every block starts on a page boundary and holds
+ * 'block_rows' rows; each column of a block is a contiguous array so it can be
+ * scanned straight out of an mmap'd file. An index at the end of the file keeps
+ * the time range and min/max of every column per block, which lets range
+ * queries skip blocks without touching them. Preemptor names are dictionary
+ * encoded.
+ *
+ * File layout (all integers in host byte order):
+ *
+ *      struct sched_trace_header
+ *      block 0, block 1, ...           page aligned, see SCHED_TRACE_COL_*
+ *      preemptor dictionary            nr_names * SCHED_TRACE_NAME_LEN bytes
+ *      struct sched_trace_block_index  one per block
+ *      struct sched_trace_trailer      last bytes of the file
+ */
+
+#include <stdint.h>
+
+#include <sched_monitor.h>
+
+#define SCHED_TRACE_MAGIC          "SMTRACE1"
+#define SCHED_TRACE_VERSION        2
+#define SCHED_TRACE_DEFAULT_ROWS   4096
+#define SCHED_TRACE_NAME_LEN       16
+
+/* Columns, in the order they appear inside a block */
+enum sched_trace_column {
+    SCHED_TRACE_COL_TIME_STAMP,    /* uint64_t */
+    SCHED_TRACE_COL_TIME_ON,       /* uint64_t */
+    SCHED_TRACE_COL_TIME_OFF,      /* uint64_t */
+    SCHED_TRACE_COL_TIME_WAIT,     /* uint64_t */
+    SCHED_TRACE_COL_CPU,           /* int32_t  */
+    SCHED_TRACE_COL_PREEMPTOR,     /* uint32_t, index into the dictionary */
+    SCHED_TRACE_COL_PID,           /* int32_t  */
+    SCHED_TRACE_COL_VOLUNTARY,     /* uint8_t  */
+    SCHED_TRACE_NR_COLUMNS,
+};
+
+struct sched_trace_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t block_rows;
+    uint32_t nr_columns;
+    uint32_t reserved;
+};
+
+struct sched_trace_block_index {
+    uint64_t offset;               /* file offset of the block */
+    uint32_t nr_rows;
+    int32_t  cpu_min;
+    int32_t  cpu_max;
+    uint32_t reserved;
+    uint64_t cpu_mask;             /* bit (cpu % 64) set if cpu occurs */
+    uint64_t time_stamp_min;
+    uint64_t time_stamp_max;
+    uint64_t time_off_min;
+    uint64_t time_off_max;
+    uint64_t time_wait_min;
+    uint64_t time_wait_max;
+};
+
+struct sched_trace_trailer {
+    uint64_t dict_offset;
+    uint64_t index_offset;
+    uint64_t nr_rows;
+    uint32_t nr_blocks;
+    uint32_t nr_names;
+    char     magic[8];
+};
+
+/* Pointers to the columns of one block, valid while the reader is open */
+struct sched_trace_block {
+    const struct sched_trace_block_index * index;
+    const uint64_t * time_stamp;
+    const uint64_t * time_on;
+    const uint64_t * time_off;
+    const uint64_t * time_wait;
+    const int32_t  * cpu;
+    const uint32_t * preemptor;
+    const int32_t  * pid;
+    const uint8_t  * voluntary;
+};
+
+/* Range query. Rows match when all conditions hold; bounds are inclusive. */
+struct sched_trace_query {
+    uint64_t time_begin;           /* time_stamp range */
+    uint64_t time_end;
+    int      cpu;                  /* -1 for any */
+    int      pid;                  /* -1 for any */
+    uint64_t min_time_off;
+    uint64_t min_time_wait;
+};
+
+/* Match everything */
+static inline void
+sched_trace_query_init(struct sched_trace_query * query)
+{
+    query->time_begin = 0;
+    query->time_end = UINT64_MAX;
+    query->cpu = -1;
+    query->pid = -1;
+    query->min_time_off = 0;
+    query->min_time_wait = 0;
+}
+
+/* Called for each matching row. Return non-zero to stop the query. */
+typedef int (*sched_trace_callback)(const preemption_info_t * row,
+                                    void                    * arg);
+
+struct sched_trace_writer;
+struct sched_trace_reader;
+
+/* Writer. block_rows must be a non-zero multiple of 64. All functions return
+ * 0 (or a valid pointer) on success and -1 (or NULL) with errno set on error.
+ */
+struct sched_trace_writer *
+sched_trace_create(const char * path,
+                   unsigned     block_rows);
+
+int
+sched_trace_append(struct sched_trace_writer * writer,
+                   const preemption_info_t   * info);
+
+/* Flushes the last block, writes dictionary, index and trailer, and frees the
+ * writer. The file is only readable after this succeeds.
+ */
+int
+sched_trace_finish(struct sched_trace_writer * writer);
+
+/* Reader, backed by a read-only mmap of the whole file */
+struct sched_trace_reader *
+sched_trace_open(const char * path);
+
+void
+sched_trace_close(struct sched_trace_reader * reader);
+
+uint64_t
+sched_trace_nr_rows(const struct sched_trace_reader * reader);
+
+unsigned
+sched_trace_nr_blocks(const struct sched_trace_reader * reader);
+
+/* Column pointers of block 'nr' */
+int
+sched_trace_get_block(const struct sched_trace_reader * reader,
+                      unsigned                          nr,
+                      struct sched_trace_block        * block);
+
+/* Preemptor name for a dictionary index, or NULL. Not NUL terminated if it is
+ * exactly SCHED_TRACE_NAME_LEN characters long.
+ */
+const char *
+sched_trace_name(const struct sched_trace_reader * reader,
+                 uint32_t                          id);
+
+/* Run a query, invoking 'cb' for matching rows in file order. Returns the
+ * number of matching rows. If 'blocks_scanned' is non-NULL it receives the
+ * number of blocks that could not be skipped using the index.
+ */
+long
+sched_trace_query(const struct sched_trace_reader * reader,
+                  const struct sched_trace_query  * query,
+                  sched_trace_callback              cb,
+                  void                            * arg,
+                  unsigned                        * blocks_scanned);
+
+#endif
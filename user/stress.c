@@ -0,0 +1,407 @@
+/******************************************************************************
+*
+* stress.c
+*
+* Scalability benchmark for /dev/sched_monitor. For N = 1, 2, 4, ... up to the
+* maximum, starts N processes spread over all cores. Each process tracks a
+* worker thread that sleeps and wakes at a fixed rate, while a reader thread
+* drains its descriptor in parallel. Per round it reports:
+*
+*        events/s   entries read per second over all processes
+*        dropped    events the module could not queue (GFP_ATOMIC failure)
+*        lag        time from an entry becoming readable to it being read
+*        cb         time spent in the scheduler callbacks, of which
+*        cb_lock      waiting for the descriptor's lock and
+*        alloc        in kmalloc(GFP_ATOMIC)
+*        rd_lock    time read() waited for the lock
+*        copy       time read() spent in copy_to_user
+*        read       time spent in one read() call, as seen from user space
+*
+*        Times are means in ns, or maxima in us for the *max columns. The
+*        module only takes the kernel side times when loaded with
+*        collect_stats=1; they read 0 otherwise.
+*
+* Usage: ./stress [-n max_procs] [-r rate] [-b busy_us] [-d seconds]
+*
+*        -n  largest number of processes (default 4 per core)
+*        -r  context switches per second per process (default 1000)
+*        -b  time spent on the CPU per period, in us (default 100)
+*        -d  duration of each round, in seconds (default 5)
+*
+******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <sched_monitor.h>
+
+#define COLLECT_STATS "/sys/module/sched_monitor/parameters/collect_stats"
+
+/* how long the reader sleeps when it finds the descriptor empty */
+#define READ_INTERVAL_NS    (100 * 1000)
+
+struct child_result {
+    int error;
+    unsigned long long events;
+    unsigned long long lag_ns;
+    unsigned long long lag_max_ns;
+    unsigned long long reads;
+    unsigned long long read_ns;
+    struct tracking_stats stats;
+};
+
+struct child {
+    int fd;
+    int cpu;
+    unsigned long long period_ns;
+    unsigned long long busy_ns;
+    unsigned long long deadline;
+    int done;
+    struct child_result result;
+};
+
+static void
+add_stats(struct tracking_stats       * total,
+          const struct tracking_stats * stats)
+{
+    total->recorded += stats->recorded;
+    total->dropped += stats->dropped;
+    total->callbacks += stats->callbacks;
+    total->callback_ns += stats->callback_ns;
+    total->lock_wait_ns += stats->lock_wait_ns;
+    total->allocs += stats->allocs;
+    total->alloc_ns += stats->alloc_ns;
+    total->reads += stats->reads;
+    total->read_lock_wait_ns += stats->read_lock_wait_ns;
+    total->copy_ns += stats->copy_ns;
+
+#define MAX(field) if (stats->field > total->field) total->field = stats->field
+    MAX(callback_max_ns);
+    MAX(lock_wait_max_ns);
+    MAX(alloc_max_ns);
+    MAX(read_lock_wait_max_ns);
+    MAX(copy_max_ns);
+#undef MAX
+}
+
+/* Mean in ns of 'total' over 'count' events */
+static double
+mean(unsigned long long total,
+     unsigned long long count)
+{
+    return count ? (double)total / count : 0.0;
+}
+
+/* Whether the module times its callbacks, see COLLECT_STATS */
+static int
+stats_collected(void)
+{
+    FILE * f = fopen(COLLECT_STATS, "r");
+    int c;
+
+    if (!f) {
+        return 0;
+    }
+    c = fgetc(f);
+    fclose(f);
+    return c == 'Y' || c == '1';
+}
+
+static unsigned long long
+now_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+sleep_ns(unsigned long long ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000ULL;
+    ts.tv_nsec = ns % 1000000000ULL;
+    nanosleep(&ts, NULL);
+}
+
+/* Tracked thread: spin for busy_ns, then sleep for the rest of the period */
+static void *
+worker(void * arg)
+{
+    struct child * child = arg;
+    unsigned long long start;
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(child->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    if (enable_preemption_tracking(child->fd) < 0) {
+        child->result.error = errno;
+        __atomic_store_n(&child->done, 1, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    while ((start = now_ns(CLOCK_MONOTONIC)) < child->deadline) {
+        while (now_ns(CLOCK_MONOTONIC) - start < child->busy_ns)
+            ;
+        if (child->period_ns > child->busy_ns) {
+            sleep_ns(child->period_ns - child->busy_ns);
+        }
+    }
+
+    disable_preemption_tracking(child->fd);
+    __atomic_store_n(&child->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Reader thread: drain the descriptor while the worker is running */
+static void *
+reader(void * arg)
+{
+    struct child * child = arg;
+    struct child_result * result = &child->result;
+    preemption_info_t buf;
+    unsigned long long before, after, lag;
+    ssize_t ret;
+    int done;
+
+    for (;;) {
+        /* sample 'done' first so the final pass sees every entry */
+        done = __atomic_load_n(&child->done, __ATOMIC_ACQUIRE);
+
+        for (;;) {
+            before = now_ns(CLOCK_MONOTONIC);
+            ret = read(child->fd, &buf, sizeof(buf));
+            after = now_ns(CLOCK_MONOTONIC);
+
+            result->reads++;
+            result->read_ns += after - before;
+
+            if (ret <= 0) {
+                break;
+            }
+
+            /* entries become readable when the task is switched out
+             * again; the module stamps them with the wall clock
+             */
+            lag = now_ns(CLOCK_REALTIME) - (buf.time_stamp + buf.time_off + buf.time_on);
+            result->events++;
+            result->lag_ns += lag;
+            if (lag > result->lag_max_ns) {
+                result->lag_max_ns = lag;
+            }
+        }
+
+        if (done) {
+            break;
+        }
+        sleep_ns(READ_INTERVAL_NS);
+    }
+
+    return NULL;
+}
+
+static void
+run_child(int                cpu,
+          int                start_fd,
+          int                result_fd,
+          unsigned long long period_ns,
+          unsigned long long busy_ns,
+          unsigned long long duration_ns)
+{
+    struct child child;
+    pthread_t worker_thread, reader_thread;
+    char c;
+
+    memset(&child, 0, sizeof(child));
+    child.cpu = cpu;
+    child.period_ns = period_ns;
+    child.busy_ns = busy_ns;
+
+    child.fd = open(DEV_NAME, O_RDWR);
+    if (child.fd < 0) {
+        child.result.error = errno;
+        write(result_fd, &child.result, sizeof(child.result));
+        _exit(1);
+    }
+
+    /* wait until every process of the round is ready */
+    while (read(start_fd, &c, 1) > 0)
+        ;
+
+    child.deadline = now_ns(CLOCK_MONOTONIC) + duration_ns;
+    pthread_create(&worker_thread, NULL, worker, &child);
+    pthread_create(&reader_thread, NULL, reader, &child);
+    pthread_join(worker_thread, NULL);
+    pthread_join(reader_thread, NULL);
+
+    if (!child.result.error && get_tracking_stats(child.fd, &child.result.stats) < 0) {
+        child.result.error = errno;
+    }
+
+    close(child.fd);
+    write(result_fd, &child.result, sizeof(child.result));
+    _exit(0);
+}
+
+static int
+run_round(int                nr_procs,
+          int                nr_cpus,
+          unsigned long long period_ns,
+          unsigned long long busy_ns,
+          unsigned long long duration_ns)
+{
+    struct child_result result, total;
+    int start_pipe[2], result_pipe[2];
+    int i, status, started = 0, failed = 0;
+    double seconds = duration_ns / 1e9;
+    pid_t pid;
+
+    if (pipe(start_pipe) < 0 || pipe(result_pipe) < 0) {
+        fprintf(stderr, "Could not create pipe: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < nr_procs; ++i) {
+        pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "Could not fork: %s\n", strerror(errno));
+            break;
+        }
+        if (pid == 0) {
+            close(start_pipe[1]);
+            close(result_pipe[0]);
+            run_child(i % nr_cpus, start_pipe[0], result_pipe[1], period_ns, busy_ns, duration_ns);
+        }
+        ++started;
+    }
+
+    /* closing the write end releases all children at once */
+    close(start_pipe[0]);
+    close(start_pipe[1]);
+    close(result_pipe[1]);
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < started; ++i) {
+        if (read(result_pipe[0], &result, sizeof(result)) != sizeof(result)) {
+            ++failed;
+            continue;
+        }
+        if (result.error) {
+            if (!failed) {
+                fprintf(stderr, "Child failed on %s: %s\n", DEV_NAME, strerror(result.error));
+            }
+            ++failed;
+            continue;
+        }
+
+        total.events += result.events;
+        total.lag_ns += result.lag_ns;
+        total.reads += result.reads;
+        total.read_ns += result.read_ns;
+        if (result.lag_max_ns > total.lag_max_ns) {
+            total.lag_max_ns = result.lag_max_ns;
+        }
+        add_stats(&total.stats, &result.stats);
+    }
+    close(result_pipe[0]);
+
+    while (wait(&status) > 0)
+        ;
+
+    if (failed || started != nr_procs) {
+        return -1;
+    }
+
+    printf("%5d %10.0f %10llu %8llu %8.1f %8.1f | %7.0f %7.1f %7.0f %7.1f %7.0f %7.1f | %7.0f %7.1f %7.0f %7.1f %7.0f\n",
+        nr_procs, total.events / seconds, total.stats.recorded, total.stats.dropped,
+        mean(total.lag_ns, total.events) / 1000.0, total.lag_max_ns / 1000.0,
+        mean(total.stats.callback_ns, total.stats.callbacks), total.stats.callback_max_ns / 1000.0,
+        mean(total.stats.lock_wait_ns, total.stats.callbacks), total.stats.lock_wait_max_ns / 1000.0,
+        mean(total.stats.alloc_ns, total.stats.allocs), total.stats.alloc_max_ns / 1000.0,
+        mean(total.stats.read_lock_wait_ns, total.stats.reads), total.stats.read_lock_wait_max_ns / 1000.0,
+        mean(total.stats.copy_ns, total.stats.reads), total.stats.copy_max_ns / 1000.0,
+        mean(total.read_ns, total.reads));
+    fflush(stdout);
+
+    return 0;
+}
+
+int
+main(int     argc,
+     char ** argv)
+{
+    unsigned long long rate = 1000, busy_us = 100, duration = 5;
+    int opt, nr_procs, max_procs, nr_cpus;
+
+    nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nr_cpus < 1) {
+        nr_cpus = 1;
+    }
+    max_procs = 4 * nr_cpus;
+
+    while ((opt = getopt(argc, argv, "n:r:b:d:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                max_procs = atoi(optarg);
+                break;
+            case 'r':
+                rate = strtoull(optarg, NULL, 0);
+                break;
+            case 'b':
+                busy_us = strtoull(optarg, NULL, 0);
+                break;
+            case 'd':
+                duration = strtoull(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n max_procs] [-r rate] [-b busy_us] [-d seconds]\n", argv[0]);
+                return -1;
+        }
+    }
+
+    if (max_procs < 1 || rate == 0 || duration == 0) {
+        fprintf(stderr, "Expected a positive number of processes, rate and duration\n");
+        return -1;
+    }
+
+    if (!stats_collected()) {
+        fprintf(stderr, "Warning: load sched_monitor with collect_stats=1 for the kernel side times\n");
+    }
+
+    printf("%d cores, %llu switches/s per process, %llu us busy per period, %llu s per round\n",
+        nr_cpus, rate, busy_us, duration);
+    printf("%5s %10s %10s %8s %8s %8s | %7s %7s %7s %7s %7s %7s | %7s %7s %7s %7s %7s\n",
+        "procs", "events/s", "recorded", "dropped", "lag", "lag_max",
+        "cb", "cb_max", "cb_lock", "lk_max", "alloc", "al_max",
+        "rd_lock", "rl_max", "copy", "cp_max", "read");
+
+    for (nr_procs = 1; ; nr_procs *= 2) {
+        if (nr_procs > max_procs) {
+            nr_procs = max_procs;
+        }
+        if (run_round(nr_procs, nr_cpus, 1000000000ULL / rate, busy_us * 1000, duration * 1000000000ULL) < 0) {
+            return -1;
+        }
+        if (nr_procs == max_procs) {
+            break;
+        }
+    }
+
+    return 0;
+}
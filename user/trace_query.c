@@ -0,0 +1,102 @@
+/******************************************************************************
+*
+* trace_query.c
+*
+* Runs a range query against a columnar preemption trace (see sched_trace.h)
+* and prints the matching preemptions as CSV.
+*
+* Usage: ./trace_query [-b begin_ns] [-e end_ns] [-c cpu] [-p pid]
+*                      [-g min_time_off_ns] [-w min_time_wait_ns] [-n] <file>
+*
+*        -n only prints the number of matches.
+*
+*        Example, all gaps longer than 1ms on CPU 3 between t1 and t2:
+*            ./trace_query -b t1 -e t2 -c 3 -g 1000000 preemptions.trace
+*
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "sched_trace.h"
+
+static int
+print_row(const preemption_info_t * row,
+          void                    * arg)
+{
+    printf("%llu,%d,%llu,%llu,%llu,%d,%d,%.16s\n", row->time_stamp, row->pid, row->time_on,
+        row->time_off, row->time_wait, row->voluntary, row->cpu, row->preempted_by);
+    return 0;
+}
+
+int
+main(int     argc,
+     char ** argv)
+{
+    struct sched_trace_reader * reader;
+    struct sched_trace_query query;
+    unsigned scanned;
+    long matches;
+    int opt, count_only = 0;
+
+    sched_trace_query_init(&query);
+
+    while ((opt = getopt(argc, argv, "b:e:c:p:g:w:nh")) != -1) {
+        switch (opt) {
+            case 'b':
+                query.time_begin = strtoull(optarg, NULL, 0);
+                break;
+            case 'e':
+                query.time_end = strtoull(optarg, NULL, 0);
+                break;
+            case 'c':
+                query.cpu = atoi(optarg);
+                break;
+            case 'p':
+                query.pid = atoi(optarg);
+                break;
+            case 'g':
+                query.min_time_off = strtoull(optarg, NULL, 0);
+                break;
+            case 'w':
+                query.min_time_wait = strtoull(optarg, NULL, 0);
+                break;
+            case 'n':
+                count_only = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-b begin_ns] [-e end_ns] [-c cpu] [-p pid] [-g min_time_off_ns] "
+                    "[-w min_time_wait_ns] [-n] <file>\n", argv[0]);
+                return -1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "Expected a single trace file\n");
+        return -1;
+    }
+
+    reader = sched_trace_open(argv[optind]);
+    if (!reader) {
+        fprintf(stderr, "Could not open trace %s: %s\n", argv[optind], strerror(errno));
+        return -1;
+    }
+
+    if (!count_only) {
+        printf("TIME_STAMP, PID, TIME_ON, TIME_OFF, TIME_WAIT, VOLUNTARY, CPU, PREEMPTED_BY\n");
+    }
+
+    matches = sched_trace_query(reader, &query, count_only ? NULL : print_row, NULL, &scanned);
+
+    fprintf(stderr, "%ld of %llu rows matched, %u of %u blocks scanned\n", matches,
+        (unsigned long long)sched_trace_nr_rows(reader), scanned, sched_trace_nr_blocks(reader));
+    if (count_only) {
+        printf("%ld\n", matches);
+    }
+
+    sched_trace_close(reader);
+    return 0;
+}